@@ -0,0 +1,227 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Accounting hot path from N threads: each thread closes txns of channels
+  drawn from a uniform or Zipf distribution, for each thread count of the
+  list. Txns are resolved to their channel before timing, as post remap
+  does, so only handle_txn_close is timed, unless -f runs all hooks.
+  Reports ns per txn of a thread, throughput, its scaling from the first
+  thread count and allocations per txn.
+
+  usage: bench_txn_close [-n txns] [-c channels] [-t threads,...]
+                         [-d uniform|zipf] [-s exponent] [-f]
+                         [-- plugin options]
+  e.g.   bench_txn_close -t 1,2,4,8 -d zipf -- --counters=sharded
+*/
+
+#include <cmath>
+#include <pthread.h>
+
+#include "../channel_stats.cc"
+#include "stub/ts_stub.h"
+
+#define SAMPLES (1 << 16) // channel draws of a thread, cycled
+
+static long txns = 1000000; // per thread
+static int channels = 10000;
+static bool zipf = false;
+static double zipf_exponent = 1.0;
+static bool full_txn = false;
+
+static std::vector<std::string> hosts;
+static std::vector<void *> channel_args; // txn arg of each channel
+static std::vector<double> zipf_cdf;
+static pthread_barrier_t start_barrier;
+
+struct bench_thread {
+  pthread_t tid;
+  unsigned seed;
+  std::vector<int> samples;
+  TSHRTime elapsed;
+};
+
+// xorshift32, each thread has its own
+static inline unsigned
+next_random(unsigned *state)
+{
+  unsigned x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static int
+draw_channel(unsigned *state)
+{
+  double u = (double) next_random(state) / 4294967296.0;
+  if (!zipf)
+    return (int) (u * channels);
+  return (int) (std::upper_bound(zipf_cdf.begin(), zipf_cdf.end() - 1, u) - zipf_cdf.begin());
+}
+
+static void *
+run_thread(void *data)
+{
+  bench_thread *bt = (bench_thread *) data;
+  stub_txn txn;
+
+  bt->samples.resize(SAMPLES);
+  for (int i = 0; i < SAMPLES; i++)
+    bt->samples[i] = draw_channel(&bt->seed);
+  stub_txn_init(&txn, hosts[0].c_str());
+
+  pthread_barrier_wait(&start_barrier);
+  TSHRTime start = TShrtime();
+  for (long i = 0; i < txns; i++) {
+    int c = bt->samples[i & (SAMPLES - 1)];
+    if (full_txn) {
+      stub_txn_init(&txn, hosts[c].c_str());
+      stub_txn_run(&txn);
+    } else {
+      txn.host = hosts[c].c_str();
+      txn.args[txn_arg_idx] = channel_args[c];
+      handle_txn_close(NULL, (TSHttpTxn) &txn);
+    }
+  }
+  bt->elapsed = TShrtime() - start;
+  return NULL;
+}
+
+// run txns from n threads, return txns per second of all threads
+static double
+run(int n, double base)
+{
+  std::vector<bench_thread> threads(n);
+  stub_alloc_stats before, after;
+
+  pthread_barrier_init(&start_barrier, NULL, n + 1);
+  for (int i = 0; i < n; i++) {
+    threads[i].seed = 2463534242U + i * 7919;
+    if (pthread_create(&threads[i].tid, NULL, run_thread, &threads[i]) != 0) {
+      fprintf(stderr, "cannot create thread\n");
+      exit(1);
+    }
+  }
+  pthread_barrier_wait(&start_barrier);
+  stub_alloc_stats_get(&before);
+  TSHRTime start = TShrtime();
+  for (int i = 0; i < n; i++)
+    pthread_join(threads[i].tid, NULL);
+  TSHRTime wall = TShrtime() - start;
+  stub_alloc_stats_get(&after);
+  pthread_barrier_destroy(&start_barrier);
+
+  TSHRTime thread_time = 0;
+  for (int i = 0; i < n; i++)
+    thread_time += threads[i].elapsed;
+  double total = (double) txns * n;
+  double txns_per_sec = total / wall * HRTIME_SECOND;
+  printf("  threads: %2d  ns/txn: %6.1f  Mtxn/s: %6.2f  scaling: %5.2fx  allocs/txn: %.3f\n",
+         n, (double) thread_time / total, txns_per_sec / 1e6,
+         base > 0 ? txns_per_sec / base : 1.0,
+         (double) (after.allocs - before.allocs) / total);
+  return txns_per_sec;
+}
+
+static void
+usage()
+{
+  fprintf(stderr, "usage: bench_txn_close [-n txns] [-c channels] [-t threads,...]\n"
+                  "                       [-d uniform|zipf] [-s exponent] [-f]\n"
+                  "                       [-- plugin options]\n");
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  std::vector<int> thread_counts;
+  const char *threads_arg = "1,2,4";
+  std::vector<const char *> plugin_argv(1, "channel_stats.so");
+  stub_txn txn;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:c:t:d:s:f")) != -1) {
+    switch (c) {
+    case 'n': txns = atol(optarg); break;
+    case 'c': channels = atoi(optarg); break;
+    case 't': threads_arg = optarg; break;
+    case 'd':
+      if (strcmp(optarg, "zipf") == 0)
+        zipf = true;
+      else if (strcmp(optarg, "uniform") != 0)
+        usage();
+      break;
+    case 's': zipf_exponent = atof(optarg); break;
+    case 'f': full_txn = true; break;
+    default: usage();
+    }
+  }
+  for (int i = optind; i < argc; i++)
+    plugin_argv.push_back(argv[i]);
+  for (const char *p = threads_arg; *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : "") {
+    int n = atoi(p);
+    if (n <= 0)
+      usage();
+    thread_counts.push_back(n);
+  }
+  if (txns <= 0 || channels <= 0 || channels > MAX_MAP_SIZE)
+    usage();
+
+  TSPluginInit(plugin_argv.size(), &plugin_argv[0]);
+
+  // create all channels and keep their txn arg, as post remap sets it
+  for (int i = 0; i < channels; i++) {
+    char host[64];
+    snprintf(host, sizeof(host), "www.channel%d.com", i);
+    hosts.push_back(host);
+  }
+  for (int i = 0; i < channels; i++) {
+    stub_txn_init(&txn, hosts[i].c_str());
+    stub_txn_run(&txn);
+    stub_txn_init(&txn, hosts[i].c_str());
+    stub_txn_run(&txn);
+    channel_args.push_back(txn.args[txn_arg_idx]);
+  }
+
+  if (zipf) {
+    double sum = 0;
+    for (int i = 0; i < channels; i++)
+      zipf_cdf.push_back(sum += 1.0 / pow(i + 1, zipf_exponent));
+    for (int i = 0; i < channels; i++)
+      zipf_cdf[i] /= sum;
+  }
+
+  printf("%s, txns: %ld per thread, channels: %d, ",
+         full_txn ? "all hooks" : "txn close", txns, channels);
+  if (zipf)
+    printf("zipf (s=%.2f)\n", zipf_exponent);
+  else
+    printf("uniform\n");
+  // scaling is throughput relative to the first thread count
+  double base = 0;
+  for (size_t i = 0; i < thread_counts.size(); i++) {
+    double rate = run(thread_counts[i], base);
+    if (i == 0)
+      base = rate;
+  }
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Count continuations and allocations per counted transaction.
+  Built twice by 'make -f Makefile.tsxs bench': as is (shared continuation)
+  and with -DPER_TXN_CONT (one continuation per txn, as version 0.2).
+
+  usage: bench_txn_cont [txns] [channels]
+*/
+
+#include "../channel_stats.cc"
+#include "stub/ts_stub.h"
+
+int
+main(int argc, char *argv[])
+{
+  long txns = argc > 1 ? atol(argv[1]) : 1000000;
+  int channels = argc > 2 ? atoi(argv[2]) : 1000;
+  const char *plugin_argv[] = {"channel_stats.so"};
+  std::vector<std::string> hosts;
+  stub_alloc_stats before, after;
+  stub_txn txn;
+
+  TSPluginInit(1, plugin_argv);
+
+  for (int i = 0; i < channels; i++) {
+    char host[64];
+    snprintf(host, sizeof(host), "www.channel%d.com", i);
+    hosts.push_back(host);
+  }
+
+  // warm up, create all channels
+  for (int i = 0; i < channels; i++) {
+    stub_txn_init(&txn, hosts[i].c_str());
+    stub_txn_run(&txn);
+  }
+
+  stub_alloc_stats_get(&before);
+  TSHRTime start = TShrtime();
+  for (long i = 0; i < txns; i++) {
+    stub_txn_init(&txn, hosts[i % channels].c_str());
+    stub_txn_run(&txn);
+  }
+  TSHRTime end = TShrtime();
+  stub_alloc_stats_get(&after);
+
+#ifdef PER_TXN_CONT
+  printf("per-txn continuation:\n");
+#else
+  printf("shared continuation:\n");
+#endif
+  printf("  txns: %ld, channels: %d\n", txns, channels);
+  printf("  continuations created: %" PRIu64 ", destroyed: %" PRIu64 "\n",
+         after.conts_created - before.conts_created,
+         after.conts_destroyed - before.conts_destroyed);
+  printf("  allocations: %" PRIu64 " (%.2f per txn), bytes: %" PRIu64 "\n",
+         after.allocs - before.allocs,
+         (double) (after.allocs - before.allocs) / txns,
+         after.alloc_bytes - before.alloc_bytes);
+  printf("  time per txn: %.1f ns\n", (double) (end - start) / txns);
+
+  return 0;
+}
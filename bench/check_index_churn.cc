@@ -0,0 +1,116 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Check lookups in the hash index under channel churn with eviction:
+  each round evicts the channels of the previous one and adds a burst of
+  new channels, several times the table capacity in all, and the slots
+  probed by a lookup of an absent host must stay bounded. Exits 1 on
+  failure.
+
+  usage: check_index_churn [rounds] [-- plugin options]
+*/
+
+#include "../channel_stats.cc"
+#include "stub/ts_stub.h"
+
+#define BURST 20000 // new channels of a round
+#define ABSENT_LOOKUPS 1000
+#define MAX_MEAN_PROBES 8
+#define MAX_PROBES 128
+
+static void
+add_channels(int round)
+{
+  stub_txn txn;
+  char host[64];
+
+  for (int i = 0; i < BURST; i++) {
+    snprintf(host, sizeof(host), "r%d-%d.example.com", round, i);
+    stub_txn_init(&txn, host);
+    stub_txn_run(&txn);
+  }
+}
+
+// sweep, then sweep again as if evict_idle had passed, evicting all
+// channels without txn in between
+static void
+evict_all()
+{
+  if (counters_type == COUNTERS_EPOCH) {
+    evict_next_sweep = 0;
+    epoch_fold();
+  } else {
+    evict_sweep(NULL);
+  }
+  for (size_t k = 0; k < evict_history.size(); k++)
+    evict_history[k].first -= evict_idle;
+  if (counters_type == COUNTERS_EPOCH) {
+    evict_next_sweep = 0;
+    epoch_fold();
+  } else {
+    evict_sweep(NULL);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  std::vector<const char *> plugin_argv(1, "channel_stats.so");
+  int rounds = 40;
+  int failed = 0;
+  int i = 1;
+
+  if (i < argc && strcmp(argv[i], "--") != 0)
+    rounds = atoi(argv[i++]);
+  if (i < argc && strcmp(argv[i], "--") == 0)
+    i++;
+  plugin_argv.push_back("--evict-idle=1");
+  for (; i < argc; i++)
+    plugin_argv.push_back(argv[i]);
+  TSPluginInit(plugin_argv.size(), &plugin_argv[0]);
+  if (index_type != INDEX_HASH) {
+    fprintf(stderr, "check_index_churn: needs --index=hash\n");
+    return 1;
+  }
+
+  for (int r = 0; r < rounds; r++) {
+    evict_all();
+    add_channels(r);
+
+    size_t total = 0, max = 0, probes;
+    char host[64];
+    for (int k = 0; k < ABSENT_LOOKUPS; k++) {
+      snprintf(host, sizeof(host), "absent%d.example.net", k);
+      channel_table->find(host, strlen(host), NULL, &probes);
+      total += probes;
+      max = std::max(max, probes);
+    }
+    bool ok = total <= (size_t) MAX_MEAN_PROBES * ABSENT_LOOKUPS && max <= MAX_PROBES;
+    if (!ok || r == rounds - 1)
+      printf("%s: round %d, %u erased, %u tombstones, absent host probes: mean %.1f, max %u\n",
+             ok ? "ok" : "FAILED", r, (uint32_t) evicted_channels,
+             (uint32_t) channel_table->tombstones(), (double) total / ABSENT_LOOKUPS,
+             (uint32_t) max);
+    if (!ok) {
+      failed = 1;
+      break;
+    }
+  }
+  return failed;
+}
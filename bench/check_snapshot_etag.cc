@@ -0,0 +1,83 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Check the snapshot ETag: two renders without txn in between have the
+  same ETag, a txn in between changes it, and a render doesn't bump the
+  generation. With --counters=epoch, the epoch is folded before each
+  render. Exits 1 on failure.
+
+  usage: check_snapshot_etag [-- plugin options]
+*/
+
+#include "../channel_stats.cc"
+#include "stub/ts_stub.h"
+
+static stats_snapshot *
+render()
+{
+  if (counters_type == COUNTERS_EPOCH)
+    epoch_fold();
+  return snapshot_render();
+}
+
+static int
+check(bool ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  return ok ? 0 : 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  std::vector<const char *> plugin_argv(1, "channel_stats.so");
+  stub_txn txn;
+  char host[64];
+  int failed = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--") != 0)
+      plugin_argv.push_back(argv[i]);
+  }
+  TSPluginInit(plugin_argv.size(), &plugin_argv[0]);
+
+  for (int i = 0; i < 100; i++) {
+    snprintf(host, sizeof(host), "www.channel%d.com", i);
+    stub_txn_init(&txn, host);
+    stub_txn_run(&txn);
+  }
+
+  stats_snapshot *a = render();
+  uint64_t generation = __atomic_load_n(&globals->generation, __ATOMIC_RELAXED);
+  stats_snapshot *b = render();
+  failed += check(strcmp(a->etag, b->etag) == 0, "same etag without txn");
+  if (counters_type != COUNTERS_EPOCH)
+    failed += check(__atomic_load_n(&globals->generation, __ATOMIC_RELAXED) == generation,
+                    "render doesn't bump the generation");
+
+  stub_txn_init(&txn, "www.channel0.com");
+  stub_txn_run(&txn);
+  stats_snapshot *c = render();
+  failed += check(strcmp(b->etag, c->etag) != 0, "other etag after a txn");
+
+  snapshot_release(a);
+  snapshot_release(b);
+  snapshot_release(c);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Check since= across a restart with --state-file: a child process counts
+  txns of some channels after an output, then exits; this process
+  attaches the state file back and a since= of that output must return
+  those channels. Exits 1 on failure.
+
+  usage: check_state_since [-- plugin options]
+*/
+
+#include <sys/wait.h>
+
+#include "../channel_stats.cc"
+#include "stub/ts_stub.h"
+
+#define CHANNELS 10
+#define CHANGED 5 // channels counted after the output
+
+static void
+run_txns(int channels)
+{
+  stub_txn txn;
+  char host[64];
+
+  for (int i = 0; i < channels; i++) {
+    snprintf(host, sizeof(host), "www.channel%d.com", i);
+    stub_txn_init(&txn, host);
+    stub_txn_run(&txn);
+  }
+}
+
+// json output since generation, and its generation
+static std::string
+render(uint64_t since, uint64_t *generation)
+{
+  intercept_state render;
+  std::string out;
+  int64_t avail;
+
+  memset(&render, 0, sizeof(render));
+  init_api_params(&render);
+  render.channel = (char *) "";
+  render.prefix = (char *) "";
+  render.suffix = (char *) "";
+  render.since = since;
+  render.resp_buffer = TSIOBufferCreate();
+  TSIOBufferReader reader = TSIOBufferReaderAlloc(render.resp_buffer);
+  while (!json_out_stats_step(&render))
+    ;
+  json_out_free(&render);
+  for (TSIOBufferBlock block = TSIOBufferReaderStart(reader); block;
+       block = TSIOBufferBlockNext(block)) {
+    const char *p = TSIOBufferBlockReadStart(block, reader, &avail);
+    out.append(p, avail);
+  }
+  TSIOBufferReaderFree(reader);
+  TSIOBufferDestroy(render.resp_buffer);
+  if (generation)
+    *generation = render.generation;
+  return out;
+}
+
+static int
+check(bool ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  return ok ? 0 : 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  std::vector<const char *> plugin_argv(1, "channel_stats.so");
+  char path[64], option[80];
+  int fds[2], status;
+  uint64_t since = 0;
+  int failed = 0;
+
+  snprintf(path, sizeof(path), "/tmp/check_state_since.%d", (int) getpid());
+  snprintf(option, sizeof(option), "--state-file=%s", path);
+  plugin_argv.push_back(option);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--") != 0)
+      plugin_argv.push_back(argv[i]);
+  }
+
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // before the restart
+    TSPluginInit(plugin_argv.size(), &plugin_argv[0]);
+    run_txns(CHANNELS);
+    render(0, &since);
+    run_txns(CHANGED);
+    if (write(fds[1], &since, sizeof(since)) != sizeof(since))
+      _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  if (pid < 0 || read(fds[0], &since, sizeof(since)) != sizeof(since) ||
+      waitpid(pid, &status, 0) != pid || status != 0) {
+    fprintf(stderr, "check_state_since: first run failed\n");
+    unlink(path);
+    return 1;
+  }
+
+  TSPluginInit(plugin_argv.size(), &plugin_argv[0]);
+  failed += check(registry.size() == CHANNELS, "channels restored");
+  std::string out = render(since, NULL);
+  int found = 0;
+  for (int i = 0; i < CHANGED; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "\"www.channel%d.com\"", i);
+    found += out.find(name) != std::string::npos;
+  }
+  failed += check(found == CHANGED, "since= of before the restart returns restored channels");
+
+  unlink(path);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,258 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Replay an access log through the plugin hooks of the stub TS API, at
+  full speed from all cores, to measure the cost of the plugin on real
+  traffic. Each record is a txn through read request, post remap and txn
+  close. The log is replayed twice: first as a baseline which builds the
+  same txns but fires no hook, then through the plugin. For each, reports
+  throughput, per-txn cost quantiles, and for the plugin memory growth
+  (RSS and allocations); the difference is the cost of the plugin.
+
+  Log format, one txn per line, fields separated by spaces or tabs, lines
+  starting with '#' are ignored:
+    host[:port] status bytes duration_ms [method]
+  e.g.
+    www.example.com 200 65536 12
+    img.example.com:8080 404 0 1 HEAD
+
+  usage: replay_log [-t threads] [-r repeat] FILE|- [-- plugin options]
+*/
+
+#include <pthread.h>
+#include <time.h>
+
+#include "../channel_stats.cc"
+#include "stub/ts_stub.h"
+
+// per-txn cost in ns, 8 buckets per power of 2, up to ~137s
+typedef log_linear_histogram<3, 36> cost_histogram;
+
+struct log_record {
+  const char *host;
+  const char *method;
+  int port;
+  int status;
+  int64_t bytes;
+  int64_t duration_ms;
+};
+
+static std::vector<log_record> records;
+static int repeat = 1;
+static bool run_hooks;
+static pthread_barrier_t start_barrier;
+
+struct replay_thread {
+  pthread_t tid;
+  int index;
+  int num_threads;
+  cost_histogram cost;
+};
+
+static inline TSHRTime
+monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t
+rss_bytes()
+{
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+// intern strings of the log, they must outlive the replay
+static const char *
+intern(std::map<std::string, const char *> *strings, const std::string &s)
+{
+  std::map<std::string, const char *>::iterator it = strings->find(s);
+  if (it != strings->end())
+    return it->second;
+  const char *p = strdup(s.c_str());
+  (*strings)[s] = p;
+  return p;
+}
+
+static bool
+load_log(FILE *f)
+{
+  std::map<std::string, const char *> strings;
+  char line[4096];
+  char host[1024], method[64];
+  long line_no = 0;
+
+  while (fgets(line, sizeof(line), f)) {
+    log_record r;
+    long long bytes, duration;
+    line_no++;
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+    method[0] = '\0';
+    if (sscanf(line, "%1023s %d %lld %lld %63s", host, &r.status, &bytes, &duration, method) < 4) {
+      fprintf(stderr, "replay_log: bad record at line %ld\n", line_no);
+      return false;
+    }
+    r.port = 80;
+    char *colon = strrchr(host, ':');
+    if (colon) {
+      *colon = '\0';
+      r.port = atoi(colon + 1);
+    }
+    r.host = intern(&strings, host);
+    r.method = method[0] ? intern(&strings, method) : TS_HTTP_METHOD_GET;
+    r.bytes = bytes;
+    r.duration_ms = duration;
+    records.push_back(r);
+  }
+  return true;
+}
+
+static void *
+replay(void *data)
+{
+  replay_thread *rt = (replay_thread *) data;
+  stub_txn txn;
+
+  pthread_barrier_wait(&start_barrier);
+  for (int k = 0; k < repeat; k++) {
+    for (size_t i = rt->index; i < records.size(); i += rt->num_threads) {
+      const log_record &r = records[i];
+      TSHRTime start = monotonic_ns();
+      stub_txn_init(&txn, r.host);
+      txn.port = r.port;
+      txn.method = r.method;
+      txn.status = r.status;
+      txn.body_bytes = r.bytes;
+      txn.milestones[TS_MILESTONE_UA_CLOSE] =
+        txn.milestones[TS_MILESTONE_UA_BEGIN] + r.duration_ms * HRTIME_MSECOND;
+      if (run_hooks)
+        stub_txn_run(&txn);
+      else
+        __asm__ __volatile__("" : : "r"(&txn) : "memory"); // keep the txn
+      rt->cost.record(monotonic_ns() - start);
+    }
+  }
+  return NULL;
+}
+
+// replay all records from n threads, return ns per txn of a thread
+static double
+run(const char *title, int n, bool hooks)
+{
+  std::vector<replay_thread> threads(n);
+  cost_histogram total_cost;
+  stub_alloc_stats before, after;
+  uint64_t rss_before;
+
+  run_hooks = hooks;
+  memset(&total_cost, 0, sizeof(total_cost));
+  pthread_barrier_init(&start_barrier, NULL, n + 1);
+  for (int i = 0; i < n; i++) {
+    threads[i].index = i;
+    threads[i].num_threads = n;
+    memset(&threads[i].cost, 0, sizeof(threads[i].cost));
+    if (pthread_create(&threads[i].tid, NULL, replay, &threads[i]) != 0) {
+      fprintf(stderr, "replay_log: cannot create thread\n");
+      exit(1);
+    }
+  }
+  rss_before = rss_bytes();
+  stub_alloc_stats_get(&before);
+  pthread_barrier_wait(&start_barrier);
+  TSHRTime start = monotonic_ns();
+  for (int i = 0; i < n; i++) {
+    pthread_join(threads[i].tid, NULL);
+    total_cost.merge(threads[i].cost);
+  }
+  TSHRTime wall = monotonic_ns() - start;
+  stub_alloc_stats_get(&after);
+  pthread_barrier_destroy(&start_barrier);
+
+  uint64_t txns = total_cost.total();
+  printf("%s:\n", title);
+  printf("  txns: %" PRIu64 ", threads: %d, %.2f Mtxn/s\n", txns, n,
+         (double) txns / wall * HRTIME_SECOND / 1e6);
+  printf("  ns/txn: p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64 ", p999 %" PRIu64 "\n",
+         total_cost.quantile(0.5, txns), total_cost.quantile(0.9, txns),
+         total_cost.quantile(0.99, txns), total_cost.quantile(0.999, txns));
+  if (hooks)
+    printf("  memory growth: RSS %" PRIu64 " KB, allocations: %" PRIu64 " (%" PRIu64 " bytes)\n",
+           (rss_bytes() - rss_before) / 1024, after.allocs - before.allocs,
+           after.alloc_bytes - before.alloc_bytes);
+  return (double) wall * n / txns;
+}
+
+static void
+usage()
+{
+  fprintf(stderr, "usage: replay_log [-t threads] [-r repeat] FILE|- [-- plugin options]\n");
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  std::vector<const char *> plugin_argv(1, "channel_stats.so");
+  FILE *f;
+  int c;
+
+  while ((c = getopt(argc, argv, "t:r:")) != -1) {
+    switch (c) {
+    case 't': threads = atoi(optarg); break;
+    case 'r': repeat = atoi(optarg); break;
+    default: usage();
+    }
+  }
+  if (optind >= argc || threads <= 0 || repeat <= 0)
+    usage();
+  if (strcmp(argv[optind], "-") == 0) {
+    f = stdin;
+  } else if ((f = fopen(argv[optind], "r")) == NULL) {
+    fprintf(stderr, "replay_log: cannot open %s\n", argv[optind]);
+    return 1;
+  }
+  if (!load_log(f))
+    return 1;
+  if (f != stdin)
+    fclose(f);
+  if (records.empty()) {
+    fprintf(stderr, "replay_log: no record\n");
+    return 1;
+  }
+  for (int i = optind + 1; i < argc; i++)
+    plugin_argv.push_back(argv[i]);
+
+  TSPluginInit(plugin_argv.size(), &plugin_argv[0]);
+
+  double baseline = run("baseline (no hook)", threads, false);
+  double plugin = run("plugin", threads, true);
+  printf("plugin cost: %.1f ns/txn of a thread over baseline\n", plugin - baseline);
+
+  return 0;
+}
@@ -0,0 +1,194 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Minimal stand-in of <ts/ts.h> for the benchmarks, declares only what
+  channel_stats.cc uses, with the same signatures as Traffic Server 3.x.
+  Implemented by ts_stub.cc, never used to build the plugin itself.
+*/
+
+#ifndef __TS_API_H__
+#define __TS_API_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define TS_VERSION_NUMBER 3004000
+#define TS_HTTP_METHOD_GET "GET"
+#define TS_MIME_FIELD_IF_NONE_MATCH "If-None-Match"
+#define TS_MIME_LEN_IF_NONE_MATCH 13
+#define TS_HTTP_METHOD_HEAD "HEAD"
+#define TS_HTTP_METHOD_POST "POST"
+#define TS_HTTP_METHOD_PUT "PUT"
+#define TS_HTTP_METHOD_DELETE "DELETE"
+#define TS_NULL_MLOC ((TSMLoc)0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tsapi_mbuffer *TSMBuffer;
+typedef struct tsapi_mloc *TSMLoc;
+typedef struct tsapi_cont *TSCont;
+typedef struct tsapi_cont *TSVConn;
+typedef struct tsapi_mutex *TSMutex;
+typedef struct tsapi_httptxn *TSHttpTxn;
+typedef struct tsapi_vio *TSVIO;
+typedef struct tsapi_iobuffer *TSIOBuffer;
+typedef struct tsapi_iobufferreader *TSIOBufferReader;
+typedef struct tsapi_iobufferblock *TSIOBufferBlock;
+typedef struct tsapi_action *TSAction;
+typedef int64_t TSHRTime;
+typedef int64_t TSMgmtInt;
+
+typedef enum { TS_ERROR = -1, TS_SUCCESS = 0 } TSReturnCode;
+typedef enum {
+  TS_EVENT_NONE = 0, TS_EVENT_IMMEDIATE = 1, TS_EVENT_TIMEOUT = 2, TS_EVENT_ERROR = 3, TS_EVENT_CONTINUE = 4,
+  TS_EVENT_VCONN_READ_READY = 100, TS_EVENT_VCONN_WRITE_READY = 101, TS_EVENT_VCONN_READ_COMPLETE = 102,
+  TS_EVENT_VCONN_WRITE_COMPLETE = 103, TS_EVENT_VCONN_EOS = 104,
+  TS_EVENT_NET_ACCEPT = 202, TS_EVENT_NET_ACCEPT_FAILED = 204,
+  TS_EVENT_HTTP_CONTINUE = 60000, TS_EVENT_HTTP_ERROR = 60001,
+  TS_EVENT_HTTP_READ_REQUEST_HDR = 60002, TS_EVENT_HTTP_POST_REMAP = 60017,
+  TS_EVENT_HTTP_TXN_CLOSE = 60012
+} TSEvent;
+typedef enum {
+  TS_HTTP_READ_REQUEST_HDR_HOOK, TS_HTTP_POST_REMAP_HOOK, TS_HTTP_TXN_CLOSE_HOOK
+} TSHttpHookID;
+typedef enum { TS_HTTP_STATUS_NONE = 0, TS_HTTP_STATUS_OK = 200 } TSHttpStatus;
+typedef enum {
+  TS_MILESTONE_NULL = -1, TS_MILESTONE_UA_BEGIN, TS_MILESTONE_UA_READ_HEADER_DONE,
+  TS_MILESTONE_UA_BEGIN_WRITE, TS_MILESTONE_UA_CLOSE, TS_MILESTONE_SERVER_FIRST_CONNECT,
+  TS_MILESTONE_SERVER_CONNECT, TS_MILESTONE_SERVER_CONNECT_END, TS_MILESTONE_SERVER_BEGIN_WRITE,
+  TS_MILESTONE_SERVER_FIRST_READ, TS_MILESTONE_SERVER_READ_HEADER_DONE, TS_MILESTONE_SERVER_CLOSE,
+  TS_MILESTONE_CACHE_OPEN_READ_BEGIN, TS_MILESTONE_CACHE_OPEN_READ_END,
+  TS_MILESTONE_CACHE_OPEN_WRITE_BEGIN, TS_MILESTONE_CACHE_OPEN_WRITE_END,
+  TS_MILESTONE_DNS_LOOKUP_BEGIN, TS_MILESTONE_DNS_LOOKUP_END, TS_MILESTONE_SM_START,
+  TS_MILESTONE_SM_FINISH, TS_MILESTONE_LAST_ENTRY
+} TSMilestonesType;
+typedef enum {
+  TS_CACHE_LOOKUP_MISS, TS_CACHE_LOOKUP_HIT_STALE, TS_CACHE_LOOKUP_HIT_FRESH, TS_CACHE_LOOKUP_SKIPPED
+} TSCacheLookupResult;
+typedef enum {
+  TS_THREAD_POOL_DEFAULT = -1, TS_THREAD_POOL_NET, TS_THREAD_POOL_TASK, TS_THREAD_POOL_SSL,
+  TS_THREAD_POOL_DNS, TS_THREAD_POOL_REMAP, TS_THREAD_POOL_CLUSTER, TS_THREAD_POOL_UDP
+} TSThreadPool;
+typedef enum { TS_SDK_VERSION_2_0 = 0, TS_SDK_VERSION_3_0 } TSSDKVersion;
+typedef enum { TS_RECORDTYPE_NULL = 0, TS_RECORDTYPE_PROCESS = 0x08 } TSRecordType;
+typedef enum {
+  TS_RECORDDATATYPE_NULL = 0, TS_RECORDDATATYPE_INT, TS_RECORDDATATYPE_FLOAT,
+  TS_RECORDDATATYPE_STRING, TS_RECORDDATATYPE_COUNTER
+} TSRecordDataType;
+typedef union {
+  int64_t rec_int; float rec_float; char *rec_string; int64_t rec_counter;
+} TSRecordData;
+typedef void (*TSRecordDumpCb)(TSRecordType rec_type, void *edata, int registered,
+                               const char *name, TSRecordDataType data_type, TSRecordData *datum);
+typedef int (*TSEventFunc)(TSCont contp, TSEvent event, void *edata);
+typedef struct {
+  char *plugin_name; char *vendor_name; char *support_email;
+} TSPluginRegistrationInfo;
+
+extern void TSDebug(const char *tag, const char *format_str, ...);
+extern int TSIsDebugTagSet(const char *t);
+extern void TSError(const char *fmt, ...);
+extern void *_TSmalloc(size_t size, const char *path);
+extern void *_TSrealloc(void *ptr, size_t size, const char *path);
+extern char *_TSstrdup(const char *str, int64_t length, const char *path);
+extern void _TSfree(void *ptr);
+#define TSmalloc(s) _TSmalloc((s), "")
+#define TSrealloc(p, s) _TSrealloc((p), (s), "")
+#define TSstrdup(p) _TSstrdup((p), -1, "")
+#define TSstrndup(p, n) _TSstrdup((p), (n), "")
+#define TSfree(p) _TSfree(p)
+extern TSHRTime TShrtime(void);
+
+extern TSReturnCode TSPluginRegister(TSSDKVersion sdk_version, TSPluginRegistrationInfo *plugin_info);
+extern const char *TSTrafficServerVersionGet(void);
+extern TSReturnCode TSMgmtIntGet(const char *var_name, TSMgmtInt *result);
+extern void TSRecordDump(TSRecordType rec_type, TSRecordDumpCb callback, void *edata);
+
+extern TSMutex TSMutexCreate(void);
+extern void TSMutexLock(TSMutex mutexp);
+extern TSReturnCode TSMutexLockTry(TSMutex mutexp);
+extern void TSMutexUnlock(TSMutex mutexp);
+
+extern TSCont TSContCreate(TSEventFunc funcp, TSMutex mutexp);
+extern void TSContDestroy(TSCont contp);
+extern void TSContDataSet(TSCont contp, void *data);
+extern void *TSContDataGet(TSCont contp);
+extern TSAction TSContSchedule(TSCont contp, TSHRTime timeout, TSThreadPool tp);
+extern TSAction TSContScheduleEvery(TSCont contp, TSHRTime every, TSThreadPool tp);
+extern void TSActionCancel(TSAction actionp);
+extern int TSContCall(TSCont contp, TSEvent event, void *edata);
+extern TSMutex TSContMutexGet(TSCont contp);
+
+extern void TSHttpHookAdd(TSHttpHookID id, TSCont contp);
+extern void TSHttpTxnHookAdd(TSHttpTxn txnp, TSHttpHookID id, TSCont contp);
+extern TSReturnCode TSHttpTxnReenable(TSHttpTxn txnp, TSEvent event);
+extern TSReturnCode TSHttpArgIndexReserve(const char *name, const char *description, int *arg_idx);
+extern void TSHttpTxnArgSet(TSHttpTxn txnp, int arg_idx, void *arg);
+extern void *TSHttpTxnArgGet(TSHttpTxn txnp, int arg_idx);
+extern TSReturnCode TSHttpTxnClientReqGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset);
+extern TSReturnCode TSHttpTxnClientRespGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset);
+extern TSReturnCode TSHttpTxnPristineUrlGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *url_loc);
+extern const struct sockaddr *TSHttpTxnClientAddrGet(TSHttpTxn txnp);
+extern int64_t TSHttpTxnClientRespBodyBytesGet(TSHttpTxn txnp);
+extern int64_t TSHttpTxnServerRespBodyBytesGet(TSHttpTxn txnp);
+extern TSReturnCode TSHttpTxnMilestoneGet(TSHttpTxn txnp, TSMilestonesType milestone, TSHRTime *time);
+extern TSReturnCode TSHttpTxnCacheLookupStatusGet(TSHttpTxn txnp, int *lookup_status);
+extern TSReturnCode TSSkipRemappingSet(TSHttpTxn txnp, int flag);
+extern void TSHttpTxnIntercept(TSCont contp, TSHttpTxn txnp);
+
+extern TSReturnCode TSHandleMLocRelease(TSMBuffer bufp, TSMLoc parent, TSMLoc mloc);
+extern const char *TSHttpHdrMethodGet(TSMBuffer bufp, TSMLoc offset, int *length);
+extern TSHttpStatus TSHttpHdrStatusGet(TSMBuffer bufp, TSMLoc offset);
+extern TSReturnCode TSHttpHdrUrlGet(TSMBuffer bufp, TSMLoc offset, TSMLoc *locp);
+extern TSMLoc TSMimeHdrFieldFind(TSMBuffer bufp, TSMLoc hdr, const char *name, int length);
+extern const char *TSMimeHdrFieldValueStringGet(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int idx, int *value_len_ptr);
+extern const char *TSUrlHostGet(TSMBuffer bufp, TSMLoc offset, int *length);
+extern int TSUrlPortGet(TSMBuffer bufp, TSMLoc offset);
+extern const char *TSUrlPathGet(TSMBuffer bufp, TSMLoc offset, int *length);
+extern const char *TSUrlHttpQueryGet(TSMBuffer bufp, TSMLoc offset, int *length);
+
+extern TSVIO TSVConnRead(TSVConn connp, TSCont contp, TSIOBuffer bufp, int64_t nbytes);
+extern TSVIO TSVConnWrite(TSVConn connp, TSCont contp, TSIOBufferReader readerp, int64_t nbytes);
+extern void TSVConnClose(TSVConn connp);
+extern void TSVConnShutdown(TSVConn connp, int read, int write);
+extern void TSVIOReenable(TSVIO viop);
+extern void TSVIONBytesSet(TSVIO viop, int64_t nbytes);
+extern int64_t TSVIONDoneGet(TSVIO viop);
+extern TSIOBuffer TSIOBufferCreate(void);
+extern void TSIOBufferDestroy(TSIOBuffer bufp);
+extern int64_t TSIOBufferWrite(TSIOBuffer bufp, const void *buf, int64_t length);
+extern int64_t TSIOBufferCopy(TSIOBuffer bufp, TSIOBufferReader readerp, int64_t length, int64_t offset);
+extern TSIOBufferReader TSIOBufferReaderAlloc(TSIOBuffer bufp);
+extern TSIOBufferReader TSIOBufferReaderClone(TSIOBufferReader readerp);
+extern void TSIOBufferReaderFree(TSIOBufferReader readerp);
+extern int64_t TSIOBufferReaderAvail(TSIOBufferReader readerp);
+extern void TSIOBufferReaderConsume(TSIOBufferReader readerp, int64_t nbytes);
+extern TSIOBufferBlock TSIOBufferReaderStart(TSIOBufferReader readerp);
+extern TSIOBufferBlock TSIOBufferBlockNext(TSIOBufferBlock blockp);
+extern const char *TSIOBufferBlockReadStart(TSIOBufferBlock blockp, TSIOBufferReader readerp, int64_t *avail);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __TS_API_H__
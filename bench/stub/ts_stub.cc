@@ -0,0 +1,668 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Stub implementation of the Traffic Server plugin API used by the
+  benchmarks. Only http transaction, mutex and allocation calls behave,
+  net/io calls just keep enough state not to crash, scheduling is a no-op.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <new>
+#include <string>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <ts/ts.h>
+#include "ts_stub.h"
+
+static stub_alloc_stats alloc_stats;
+
+static inline void
+count_alloc(size_t size)
+{
+  __sync_fetch_and_add(&alloc_stats.allocs, 1);
+  __sync_fetch_and_add(&alloc_stats.alloc_bytes, size);
+}
+
+void *
+operator new(size_t size)
+{
+  count_alloc(size);
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *
+operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void *
+operator new(size_t size, const std::nothrow_t &) throw()
+{
+  count_alloc(size);
+  return malloc(size ? size : 1);
+}
+
+void *
+operator new[](size_t size, const std::nothrow_t &nt) throw()
+{
+  return operator new(size, nt);
+}
+
+void
+operator delete(void *p) throw()
+{
+  free(p);
+}
+
+void
+operator delete[](void *p) throw()
+{
+  free(p);
+}
+
+void
+operator delete(void *p, size_t) throw()
+{
+  free(p);
+}
+
+void
+operator delete[](void *p, size_t) throw()
+{
+  free(p);
+}
+
+void
+stub_alloc_stats_get(stub_alloc_stats *stats)
+{
+  stats->allocs = __sync_fetch_and_add(&alloc_stats.allocs, 0);
+  stats->alloc_bytes = __sync_fetch_and_add(&alloc_stats.alloc_bytes, 0);
+  stats->conts_created = __sync_fetch_and_add(&alloc_stats.conts_created, 0);
+  stats->conts_destroyed = __sync_fetch_and_add(&alloc_stats.conts_destroyed, 0);
+}
+
+// transaction driver
+
+#define HDR_LOC ((TSMLoc) 1)
+#define URL_LOC ((TSMLoc) 2)
+
+static TSCont global_hooks[TS_HTTP_TXN_CLOSE_HOOK + 1][STUB_MAX_TXN_HOOKS];
+static int num_global_hooks[TS_HTTP_TXN_CLOSE_HOOK + 1];
+static int num_args = 0;
+
+void
+stub_txn_init(stub_txn *txn, const char *host)
+{
+  memset(txn, 0, sizeof(*txn));
+  txn->method = TS_HTTP_METHOD_GET;
+  txn->host = host;
+  txn->port = 80;
+  txn->path = "";
+  txn->query = "";
+  txn->client_addr.sin_family = AF_INET;
+  txn->client_addr.sin_addr.s_addr = inet_addr("10.0.0.1");
+  txn->status = 200;
+  txn->body_bytes = 65536;
+  txn->server_body_bytes = 0; // served from cache
+  txn->cache_lookup_status = TS_CACHE_LOOKUP_HIT_FRESH;
+  txn->milestones[TS_MILESTONE_UA_BEGIN] = 1000000000LL;
+  txn->milestones[TS_MILESTONE_UA_CLOSE] = 1010000000LL;
+}
+
+static void
+fire_hook(stub_txn *txn, TSHttpHookID id, TSEvent event)
+{
+  for (int i = 0; i < num_global_hooks[id]; i++) {
+    TSCont contp = global_hooks[id][i];
+    TSContCall(contp, event, txn);
+  }
+  // hooks may add hooks, only those added before are fired
+  int n = txn->num_hooks;
+  for (int i = 0; i < n; i++) {
+    if (txn->hook_ids[i] == id)
+      TSContCall(txn->hooks[i], event, txn);
+  }
+}
+
+void
+stub_txn_run(stub_txn *txn)
+{
+  fire_hook(txn, TS_HTTP_READ_REQUEST_HDR_HOOK, TS_EVENT_HTTP_READ_REQUEST_HDR);
+  if (txn->intercept)
+    return; // response is served by plugin, not simulated
+  fire_hook(txn, TS_HTTP_POST_REMAP_HOOK, TS_EVENT_HTTP_POST_REMAP);
+  fire_hook(txn, TS_HTTP_TXN_CLOSE_HOOK, TS_EVENT_HTTP_TXN_CLOSE);
+}
+
+// misc
+
+void
+TSDebug(const char *, const char *, ...)
+{
+}
+
+int
+TSIsDebugTagSet(const char *)
+{
+  return 0;
+}
+
+void
+TSError(const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+void *
+_TSmalloc(size_t size, const char *)
+{
+  count_alloc(size);
+  return malloc(size);
+}
+
+void *
+_TSrealloc(void *ptr, size_t size, const char *)
+{
+  count_alloc(size);
+  return realloc(ptr, size);
+}
+
+char *
+_TSstrdup(const char *str, int64_t length, const char *)
+{
+  if (length < 0)
+    length = strlen(str);
+  char *p = (char *) _TSmalloc(length + 1, NULL);
+  memcpy(p, str, length);
+  p[length] = '\0';
+  return p;
+}
+
+void
+_TSfree(void *ptr)
+{
+  free(ptr);
+}
+
+TSHRTime
+TShrtime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+TSReturnCode
+TSPluginRegister(TSSDKVersion, TSPluginRegistrationInfo *)
+{
+  return TS_SUCCESS;
+}
+
+const char *
+TSTrafficServerVersionGet(void)
+{
+  return "3.4.0";
+}
+
+TSReturnCode
+TSMgmtIntGet(const char *, TSMgmtInt *)
+{
+  return TS_ERROR;
+}
+
+void
+TSRecordDump(TSRecordType, TSRecordDumpCb, void *)
+{
+}
+
+// mutex and continuation
+
+struct tsapi_mutex {
+  pthread_mutex_t m;
+};
+
+struct tsapi_cont {
+  TSEventFunc func;
+  TSMutex mutex;
+  void *data;
+};
+
+TSMutex
+TSMutexCreate(void)
+{
+  TSMutex mutexp = new tsapi_mutex;
+  pthread_mutex_init(&mutexp->m, NULL);
+  return mutexp;
+}
+
+void
+TSMutexLock(TSMutex mutexp)
+{
+  pthread_mutex_lock(&mutexp->m);
+}
+
+TSReturnCode
+TSMutexLockTry(TSMutex mutexp)
+{
+  return pthread_mutex_trylock(&mutexp->m) == 0 ? TS_SUCCESS : TS_ERROR;
+}
+
+void
+TSMutexUnlock(TSMutex mutexp)
+{
+  pthread_mutex_unlock(&mutexp->m);
+}
+
+TSCont
+TSContCreate(TSEventFunc funcp, TSMutex mutexp)
+{
+  __sync_fetch_and_add(&alloc_stats.conts_created, 1);
+  TSCont contp = new tsapi_cont;
+  contp->func = funcp;
+  contp->mutex = mutexp;
+  contp->data = NULL;
+  return contp;
+}
+
+void
+TSContDestroy(TSCont contp)
+{
+  __sync_fetch_and_add(&alloc_stats.conts_destroyed, 1);
+  delete contp;
+}
+
+void
+TSContDataSet(TSCont contp, void *data)
+{
+  contp->data = data;
+}
+
+void *
+TSContDataGet(TSCont contp)
+{
+  return contp->data;
+}
+
+TSAction
+TSContSchedule(TSCont, TSHRTime, TSThreadPool)
+{
+  return NULL;
+}
+
+TSAction
+TSContScheduleEvery(TSCont, TSHRTime, TSThreadPool)
+{
+  return NULL;
+}
+
+void
+TSActionCancel(TSAction)
+{
+}
+
+int
+TSContCall(TSCont contp, TSEvent event, void *edata)
+{
+  TSMutex mutexp = contp->mutex; // handler may destroy contp
+  if (mutexp)
+    TSMutexLock(mutexp);
+  int ret = contp->func(contp, event, edata);
+  if (mutexp)
+    TSMutexUnlock(mutexp);
+  return ret;
+}
+
+TSMutex
+TSContMutexGet(TSCont contp)
+{
+  return contp->mutex;
+}
+
+// http transaction
+
+void
+TSHttpHookAdd(TSHttpHookID id, TSCont contp)
+{
+  if (num_global_hooks[id] < STUB_MAX_TXN_HOOKS)
+    global_hooks[id][num_global_hooks[id]++] = contp;
+}
+
+void
+TSHttpTxnHookAdd(TSHttpTxn txnp, TSHttpHookID id, TSCont contp)
+{
+  stub_txn *txn = (stub_txn *) txnp;
+  if (txn->num_hooks < STUB_MAX_TXN_HOOKS) {
+    txn->hook_ids[txn->num_hooks] = id;
+    txn->hooks[txn->num_hooks++] = contp;
+  }
+}
+
+TSReturnCode
+TSHttpTxnReenable(TSHttpTxn, TSEvent)
+{
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHttpArgIndexReserve(const char *, const char *, int *arg_idx)
+{
+  if (num_args >= STUB_MAX_TXN_ARGS)
+    return TS_ERROR;
+  *arg_idx = num_args++;
+  return TS_SUCCESS;
+}
+
+void
+TSHttpTxnArgSet(TSHttpTxn txnp, int arg_idx, void *arg)
+{
+  ((stub_txn *) txnp)->args[arg_idx] = arg;
+}
+
+void *
+TSHttpTxnArgGet(TSHttpTxn txnp, int arg_idx)
+{
+  return ((stub_txn *) txnp)->args[arg_idx];
+}
+
+TSReturnCode
+TSHttpTxnClientReqGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset)
+{
+  *bufp = (TSMBuffer) txnp;
+  *offset = HDR_LOC;
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHttpTxnClientRespGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset)
+{
+  *bufp = (TSMBuffer) txnp;
+  *offset = HDR_LOC;
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHttpTxnPristineUrlGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *url_loc)
+{
+  *bufp = (TSMBuffer) txnp;
+  *url_loc = URL_LOC;
+  return TS_SUCCESS;
+}
+
+const struct sockaddr *
+TSHttpTxnClientAddrGet(TSHttpTxn txnp)
+{
+  return (const struct sockaddr *) &((stub_txn *) txnp)->client_addr;
+}
+
+int64_t
+TSHttpTxnClientRespBodyBytesGet(TSHttpTxn txnp)
+{
+  return ((stub_txn *) txnp)->body_bytes;
+}
+
+int64_t
+TSHttpTxnServerRespBodyBytesGet(TSHttpTxn txnp)
+{
+  return ((stub_txn *) txnp)->server_body_bytes;
+}
+
+TSReturnCode
+TSHttpTxnMilestoneGet(TSHttpTxn txnp, TSMilestonesType milestone, TSHRTime *time)
+{
+  *time = ((stub_txn *) txnp)->milestones[milestone];
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHttpTxnCacheLookupStatusGet(TSHttpTxn txnp, int *lookup_status)
+{
+  *lookup_status = ((stub_txn *) txnp)->cache_lookup_status;
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSSkipRemappingSet(TSHttpTxn, int)
+{
+  return TS_SUCCESS;
+}
+
+void
+TSHttpTxnIntercept(TSCont contp, TSHttpTxn txnp)
+{
+  ((stub_txn *) txnp)->intercept = contp;
+}
+
+// header and url, bufp is the stub_txn itself
+
+TSReturnCode
+TSHandleMLocRelease(TSMBuffer, TSMLoc, TSMLoc)
+{
+  return TS_SUCCESS;
+}
+
+const char *
+TSHttpHdrMethodGet(TSMBuffer bufp, TSMLoc, int *length)
+{
+  const char *method = ((stub_txn *) bufp)->method;
+  *length = strlen(method);
+  return method;
+}
+
+TSHttpStatus
+TSHttpHdrStatusGet(TSMBuffer bufp, TSMLoc)
+{
+  return (TSHttpStatus) ((stub_txn *) bufp)->status;
+}
+
+TSReturnCode
+TSHttpHdrUrlGet(TSMBuffer, TSMLoc, TSMLoc *locp)
+{
+  *locp = URL_LOC;
+  return TS_SUCCESS;
+}
+
+TSMLoc
+TSMimeHdrFieldFind(TSMBuffer, TSMLoc, const char *, int)
+{
+  return TS_NULL_MLOC;
+}
+
+const char *
+TSMimeHdrFieldValueStringGet(TSMBuffer, TSMLoc, TSMLoc, int, int *value_len_ptr)
+{
+  *value_len_ptr = 0;
+  return NULL;
+}
+
+const char *
+TSUrlHostGet(TSMBuffer bufp, TSMLoc, int *length)
+{
+  const char *host = ((stub_txn *) bufp)->host;
+  *length = strlen(host);
+  return host;
+}
+
+int
+TSUrlPortGet(TSMBuffer bufp, TSMLoc)
+{
+  return ((stub_txn *) bufp)->port;
+}
+
+const char *
+TSUrlPathGet(TSMBuffer bufp, TSMLoc, int *length)
+{
+  const char *path = ((stub_txn *) bufp)->path;
+  *length = strlen(path);
+  return path;
+}
+
+const char *
+TSUrlHttpQueryGet(TSMBuffer bufp, TSMLoc, int *length)
+{
+  const char *query = ((stub_txn *) bufp)->query;
+  *length = strlen(query);
+  return query;
+}
+
+// net and io, a buffer is a string, a reader is an offset in it
+
+struct tsapi_iobuffer {
+  std::string data;
+};
+
+struct tsapi_iobufferreader {
+  TSIOBuffer buffer;
+  size_t offset;
+};
+
+struct tsapi_vio {
+  int64_t nbytes;
+};
+
+static tsapi_vio dummy_vio;
+
+TSVIO
+TSVConnRead(TSVConn, TSCont, TSIOBuffer, int64_t)
+{
+  return &dummy_vio;
+}
+
+TSVIO
+TSVConnWrite(TSVConn, TSCont, TSIOBufferReader, int64_t)
+{
+  return &dummy_vio;
+}
+
+void
+TSVConnClose(TSVConn)
+{
+}
+
+void
+TSVConnShutdown(TSVConn, int, int)
+{
+}
+
+void
+TSVIOReenable(TSVIO)
+{
+}
+
+void
+TSVIONBytesSet(TSVIO viop, int64_t nbytes)
+{
+  viop->nbytes = nbytes;
+}
+
+int64_t
+TSVIONDoneGet(TSVIO)
+{
+  return 0;
+}
+
+TSIOBuffer
+TSIOBufferCreate(void)
+{
+  return new tsapi_iobuffer;
+}
+
+void
+TSIOBufferDestroy(TSIOBuffer bufp)
+{
+  delete bufp;
+}
+
+int64_t
+TSIOBufferWrite(TSIOBuffer bufp, const void *buf, int64_t length)
+{
+  bufp->data.append((const char *) buf, length);
+  return length;
+}
+
+int64_t
+TSIOBufferCopy(TSIOBuffer bufp, TSIOBufferReader readerp, int64_t length, int64_t offset)
+{
+  bufp->data.append(readerp->buffer->data, readerp->offset + offset, length);
+  return length;
+}
+
+TSIOBufferReader
+TSIOBufferReaderAlloc(TSIOBuffer bufp)
+{
+  TSIOBufferReader readerp = new tsapi_iobufferreader;
+  readerp->buffer = bufp;
+  readerp->offset = 0;
+  return readerp;
+}
+
+TSIOBufferReader
+TSIOBufferReaderClone(TSIOBufferReader readerp)
+{
+  return new tsapi_iobufferreader(*readerp);
+}
+
+void
+TSIOBufferReaderFree(TSIOBufferReader readerp)
+{
+  delete readerp;
+}
+
+int64_t
+TSIOBufferReaderAvail(TSIOBufferReader readerp)
+{
+  return readerp->buffer->data.size() - readerp->offset;
+}
+
+void
+TSIOBufferReaderConsume(TSIOBufferReader readerp, int64_t nbytes)
+{
+  readerp->offset += nbytes;
+}
+
+TSIOBufferBlock
+TSIOBufferReaderStart(TSIOBufferReader readerp)
+{
+  return TSIOBufferReaderAvail(readerp) > 0 ? (TSIOBufferBlock) readerp->buffer : NULL;
+}
+
+TSIOBufferBlock
+TSIOBufferBlockNext(TSIOBufferBlock)
+{
+  return NULL;
+}
+
+const char *
+TSIOBufferBlockReadStart(TSIOBufferBlock, TSIOBufferReader readerp, int64_t *avail)
+{
+  *avail = TSIOBufferReaderAvail(readerp);
+  return readerp->buffer->data.data() + readerp->offset;
+}
@@ -0,0 +1,74 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Driver side of the stub Traffic Server: a benchmark fills a stub_txn
+  and runs it through the hooks the plugin registered, the same order
+  Traffic Server would: READ_REQUEST_HDR, POST_REMAP, TXN_CLOSE.
+*/
+
+#ifndef _TS_STUB_H
+#define _TS_STUB_H
+
+#include <ts/ts.h>
+
+#define STUB_MAX_TXN_HOOKS 8
+#define STUB_MAX_TXN_ARGS 16
+
+struct stub_txn {
+  // request
+  const char *method;
+  const char *host; // pristine host
+  int port;
+  const char *path; // without leading '/'
+  const char *query;
+  struct sockaddr_in client_addr;
+
+  // response
+  int status;
+  int64_t body_bytes;
+  int64_t server_body_bytes;
+  int cache_lookup_status;
+  TSHRTime milestones[TS_MILESTONE_LAST_ENTRY];
+
+  // filled by plugin
+  void *args[STUB_MAX_TXN_ARGS];
+  int num_hooks;
+  TSHttpHookID hook_ids[STUB_MAX_TXN_HOOKS];
+  TSCont hooks[STUB_MAX_TXN_HOOKS];
+  TSCont intercept;
+};
+
+struct stub_alloc_stats {
+  uint64_t allocs; // malloc-like calls, including operator new
+  uint64_t alloc_bytes;
+  uint64_t conts_created;
+  uint64_t conts_destroyed;
+};
+
+// a GET of http://host/ from 10.0.0.1, 200 with 64KB body in 10ms, a fresh
+// cache hit
+void stub_txn_init(stub_txn *txn, const char *host);
+
+// run txn through registered hooks, txn can be init and run again
+void stub_txn_run(stub_txn *txn);
+
+// process wide counters since start
+void stub_alloc_stats_get(stub_alloc_stats *stats);
+
+#endif //_TS_STUB_H
@@ -0,0 +1,225 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_FILTER_H
+#define _CHANNEL_FILTER_H
+
+#include <stdint.h>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "channel_registry.h"
+
+/*
+  Filters of the api on channel names "host[:port]":
+  - substring (channel=): name contains it
+  - prefix (prefix=): name starts with it
+  - domain (suffix=): host is the domain or one of its subdomains, port
+    ignored, e.g. "customer.com" matches "customer.com" and
+    "img.customer.com:8080". A leading dot (".customer.com") only matches
+    subdomains.
+*/
+
+// length of host in "host[:port]"
+static inline size_t
+filter_host_len(const char *name, size_t len)
+{
+  for (size_t i = len; i > 0; i--) {
+    if (name[i - 1] == ':')
+      return i - 1;
+    if (name[i - 1] < '0' || name[i - 1] > '9')
+      break;
+  }
+  return len;
+}
+
+static inline bool
+filter_match_prefix(const char *name, size_t len, const char *prefix, size_t prefix_len)
+{
+  return len >= prefix_len && memcmp(name, prefix, prefix_len) == 0;
+}
+
+static inline bool
+filter_match_domain(const char *name, size_t len, const char *domain, size_t domain_len)
+{
+  size_t host_len = filter_host_len(name, len);
+
+  if (domain_len == 0 || host_len < domain_len ||
+      memcmp(name + host_len - domain_len, domain, domain_len) != 0)
+    return false;
+  if (domain[0] == '.')
+    return host_len > domain_len;
+  return host_len == domain_len || name[host_len - domain_len - 1] == '.';
+}
+
+/*
+  Filter index: ids of the channels matching a filter, without looking at
+  all names.
+  - domains: a reversed-label trie of hosts. It's flattened, each node is
+    a label-aligned suffix of hosts ("com", "customer.com", ...) mapped
+    to the channels of that host and of its subdomains, so a domain
+    costs one lookup, plus its matches.
+  - trigrams: for each 3 bytes, channels whose name contains them. Names
+    are framed by FILTER_BEGIN, so a prefix is a substring starting with
+    it. A substring takes the shortest list of its trigrams, candidates
+    must be checked by the filter.
+  All lists are sorted, ids are usually added in increasing order, a
+  reused id is inserted in place.
+  add(), remove() and find_*() must be serialized by the caller.
+*/
+
+#define FILTER_BEGIN '\001'
+
+class channel_filter_index
+{
+public:
+  void add(channel_id id, const char *name, size_t len) {
+    size_t host_len = filter_host_len(name, len);
+
+    // the host itself, then every parent domain
+    insert_id(&domains_[std::string(name, host_len)].exact, id);
+    for (size_t i = 0; i < host_len; i++) {
+      if (name[i] == '.' && i + 1 < host_len)
+        insert_id(&domains_[std::string(name + i + 1, host_len - i - 1)].below, id);
+    }
+
+    uint32_t key = (unsigned char) FILTER_BEGIN;
+    for (size_t i = 0; i < len; i++) {
+      key = ((key << 8) | (unsigned char) name[i]) & 0xffffff;
+      if (i >= 1)
+        insert_id(&trigrams_[key], id); // once per channel
+    }
+  }
+
+  // remove channel id, added with the same name
+  void remove(channel_id id, const char *name, size_t len) {
+    size_t host_len = filter_host_len(name, len);
+
+    remove_domain(std::string(name, host_len), &domain_node::exact, id);
+    for (size_t i = 0; i < host_len; i++) {
+      if (name[i] == '.' && i + 1 < host_len)
+        remove_domain(std::string(name + i + 1, host_len - i - 1), &domain_node::below, id);
+    }
+
+    uint32_t key = (unsigned char) FILTER_BEGIN;
+    for (size_t i = 0; i < len; i++) {
+      key = ((key << 8) | (unsigned char) name[i]) & 0xffffff;
+      if (i < 1)
+        continue;
+      trigram_map::iterator it = trigrams_.find(key);
+      if (it != trigrams_.end() && erase_id(&it->second, id) && it->second.empty())
+        trigrams_.erase(it);
+    }
+  }
+
+  // channels below count of a domain (all of them match it)
+  void find_domain(const char *domain, size_t len, channel_id count,
+                   std::vector<channel_id> *out) const {
+    bool below_only = len > 0 && domain[0] == '.';
+    if (below_only) {
+      domain++;
+      len--;
+    }
+
+    domain_map::const_iterator it = domains_.find(std::string(domain, len));
+    if (it == domains_.end())
+      return;
+    const std::vector<channel_id> &below = it->second.below;
+    const std::vector<channel_id> &exact = it->second.exact;
+    if (below_only) {
+      out->assign(below.begin(), std::lower_bound(below.begin(), below.end(), count));
+    } else {
+      std::merge(below.begin(), std::lower_bound(below.begin(), below.end(), count),
+                 exact.begin(), std::lower_bound(exact.begin(), exact.end(), count),
+                 std::back_inserter(*out));
+    }
+  }
+
+  /*
+    Candidate channels below count for a substring, or a prefix if anchored.
+    Return false if it's too short to use the index.
+  */
+  bool find_substring(const char *s, size_t len, bool anchored, channel_id count,
+                      std::vector<channel_id> *out) const {
+    const std::vector<channel_id> *shortest = NULL;
+
+    if (len + (anchored ? 1 : 0) < 3)
+      return false;
+    uint32_t key = (unsigned char) (anchored ? FILTER_BEGIN : s[0]);
+    size_t n = 1; // bytes in key
+
+    for (const char *p = s + (anchored ? 0 : 1); p < s + len; p++) {
+      key = ((key << 8) | (unsigned char) *p) & 0xffffff;
+      if (++n < 3)
+        continue;
+      trigram_map::const_iterator it = trigrams_.find(key);
+      if (it == trigrams_.end())
+        return true; // no channel has it
+      if (!shortest || it->second.size() < shortest->size())
+        shortest = &it->second;
+    }
+    out->assign(shortest->begin(), std::lower_bound(shortest->begin(), shortest->end(), count));
+    return true;
+  }
+
+private:
+  struct domain_node {
+    std::vector<channel_id> exact; // host is the domain
+    std::vector<channel_id> below; // host is a subdomain
+  };
+  typedef std::map<std::string, domain_node> domain_map;
+  typedef std::map<uint32_t, std::vector<channel_id> > trigram_map;
+
+  // insert id in sorted ids unless it's there, usually at the end
+  static void insert_id(std::vector<channel_id> *ids, channel_id id) {
+    if (ids->empty() || ids->back() < id) {
+      ids->push_back(id);
+      return;
+    }
+    std::vector<channel_id>::iterator it = std::lower_bound(ids->begin(), ids->end(), id);
+    if (*it != id)
+      ids->insert(it, id);
+  }
+
+  // remove id from sorted ids, false if it isn't there
+  static bool erase_id(std::vector<channel_id> *ids, channel_id id) {
+    std::vector<channel_id>::iterator it = std::lower_bound(ids->begin(), ids->end(), id);
+    if (it == ids->end() || *it != id)
+      return false;
+    ids->erase(it);
+    return true;
+  }
+
+  void remove_domain(const std::string &domain, std::vector<channel_id> domain_node::*list,
+                     channel_id id) {
+    domain_map::iterator it = domains_.find(domain);
+    if (it == domains_.end() || !erase_id(&(it->second.*list), id))
+      return;
+    if (it->second.exact.empty() && it->second.below.empty())
+      domains_.erase(it);
+  }
+
+  domain_map domains_;
+  trigram_map trigrams_;
+};
+
+#endif //_CHANNEL_FILTER_H
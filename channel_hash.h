@@ -0,0 +1,181 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_HASH_H
+#define _CHANNEL_HASH_H
+
+#include <stdint.h>
+#include <cstring>
+
+#include <ts/ts.h>
+
+#include "channel_registry.h"
+
+/*
+  Fixed capacity open-addressing (linear probing) hash table, maps channel
+  name to channel id, built for "many readers, rare writers":
+  - names are kept by the registry, a slot is only (hash, id) packed in 64
+    bits, so it's read and published by a single atomic load/store
+  - find() takes no lock. A slot is published by a release store after the
+    channel is published in registry, so a reader which observes a slot also
+    observes the complete name.
+  - insert() and erase() must be serialized by the caller (e.g. holding
+    a TSMutex).
+  - slots never move and capacity never changes. An erased slot becomes a
+    tombstone, which a lookup passes over and an insert reuses, so a reader
+    never misses a key which is in the table. With registry reuse, a slot
+    read before its id is retired and reused is told apart by the tag.
+    Tombstones only go away with the table: once there are many, the
+    caller builds a new one, see tombstones().
+*/
+
+static inline uint32_t
+channel_hash_key(const char *key, size_t len)
+{
+  // 64-bit FNV-1a, folded to 32 bits so the low bits mix the whole key
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) key[i];
+    h *= 1099511628211ULL;
+  }
+  return (uint32_t) (h ^ (h >> 32));
+}
+
+class channel_hash
+{
+public:
+  // max_size is the max number of items, table keeps load factor <= 0.5
+  channel_hash(const channel_registry *registry, size_t max_size)
+      : registry_(registry), mask_(capacity(max_size) - 1), tombstones_(0), owned_(true) {
+    slots_ = (uint64_t *) TSmalloc(memory_size(max_size));
+    memset(slots_, 0, memory_size(max_size));
+  }
+
+  // use memory of memory_size() bytes, zeroed or from a table of same size
+  channel_hash(const channel_registry *registry, size_t max_size, void *memory)
+      : registry_(registry), slots_((uint64_t *) memory), mask_(capacity(max_size) - 1),
+        tombstones_(0), owned_(false) {
+  }
+
+  ~channel_hash() {
+    if (owned_)
+      TSfree(slots_);
+  }
+
+  static size_t memory_size(size_t max_size) {
+    return capacity(max_size) * sizeof(uint64_t);
+  }
+
+  /*
+    id of key, and its registry tag if tag isn't NULL. probes, if not
+    NULL, is set to the number of slots read.
+  */
+  channel_id find(const char *key, size_t len, uint32_t *tag = NULL,
+                  size_t *probes = NULL) const {
+    uint32_t hash = channel_hash_key(key, len);
+    size_t i = hash & mask_;
+    size_t n;
+    for (n = 0; n <= mask_; n++) {
+      uint64_t slot = __atomic_load_n(&slots_[i], __ATOMIC_ACQUIRE);
+      if (slot == 0)
+        break;
+      if (slot != TOMBSTONE && slot_hash(slot) == hash) {
+        channel_id id = slot_id(slot);
+        uint32_t id_tag = registry_->tag(id);
+        if (registry_->has_name(id, id_tag, key, len)) {
+          if (tag)
+            *tag = id_tag;
+          if (probes)
+            *probes = n + 1;
+          return id;
+        }
+      }
+      i = (i + 1) & mask_;
+    }
+    if (probes)
+      *probes = n <= mask_ ? n + 1 : n;
+    return CHANNEL_ID_NONE;
+  }
+
+  /*
+    Map key to id which is just added to registry, caller must hold the
+    writer lock and have looked up the key in the same lock.
+  */
+  void insert(const char *key, size_t len, channel_id id) {
+    uint32_t hash = channel_hash_key(key, len);
+    size_t i = hash & mask_;
+    while (slots_[i] != 0 && slots_[i] != TOMBSTONE)
+      i = (i + 1) & mask_;
+    if (slots_[i] == TOMBSTONE)
+      tombstones_--;
+    __atomic_store_n(&slots_[i], ((uint64_t) hash << 32) | (id + 1), __ATOMIC_RELEASE);
+  }
+
+  // unmap key of id, caller must hold the writer lock
+  void erase(const char *key, size_t len, channel_id id) {
+    uint32_t hash = channel_hash_key(key, len);
+    size_t i = hash & mask_;
+    for (size_t n = 0; n <= mask_ && slots_[i] != 0; n++) {
+      if (slots_[i] != TOMBSTONE && slot_id(slots_[i]) == id) {
+        __atomic_store_n(&slots_[i], TOMBSTONE, __ATOMIC_RELEASE);
+        tombstones_++;
+        return;
+      }
+      i = (i + 1) & mask_;
+    }
+  }
+
+  // erased slots not reused yet, guarded by the writer lock
+  size_t tombstones() const {
+    return tombstones_;
+  }
+
+  size_t slots() const {
+    return mask_ + 1;
+  }
+
+private:
+  static size_t capacity(size_t max_size) {
+    size_t capacity = 16;
+    while (capacity < max_size * 2)
+      capacity <<= 1;
+    return capacity;
+  }
+
+  // slot: hash in high 32 bits, id + 1 in low 32 bits, 0 means empty
+  static const uint64_t TOMBSTONE = 0xffffffff; // id + 1 of no channel
+  static uint32_t slot_hash(uint64_t slot) {
+    return (uint32_t) (slot >> 32);
+  }
+
+  static channel_id slot_id(uint64_t slot) {
+    return (channel_id) (slot & 0xffffffff) - 1;
+  }
+
+  const channel_registry *registry_;
+  uint64_t *slots_;
+  size_t mask_;
+  size_t tombstones_;
+  bool owned_; // slots_ is freed with the table
+
+  // not copyable
+  channel_hash(const channel_hash &);
+  channel_hash &operator=(const channel_hash &);
+};
+
+#endif //_CHANNEL_HASH_H
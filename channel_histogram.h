@@ -0,0 +1,104 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_HISTOGRAM_H
+#define _CHANNEL_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+  Fixed size log-linear histogram (HDR histogram style), bucket layout is
+  decided at compile time:
+  - values in [0, 2^SUB_BITS) have a bucket each
+  - each power of 2 range [2^e, 2^(e+1)) above is split into 2^SUB_BITS
+    buckets of equal width, so relative error of a quantile is at most
+    1 / 2^(SUB_BITS+1) when reported at bucket middle
+  - values >= 2^(MAX_EXP+1) all go to the last bucket
+  An update is a bit scan, a shift and an atomic increment. Histograms of
+  the same layout merge by adding buckets.
+*/
+template<int SUB_BITS, int MAX_EXP>
+struct log_linear_histogram
+{
+  enum {
+    SUB_BUCKETS = 1 << SUB_BITS,
+    BUCKETS = (MAX_EXP - SUB_BITS + 2) * SUB_BUCKETS
+  };
+
+  static inline uint32_t index(uint64_t value) {
+    if (value < SUB_BUCKETS)
+      return (uint32_t) value;
+    int exp = 63 - __builtin_clzll(value); // >= SUB_BITS
+    if (exp > MAX_EXP)
+      return BUCKETS - 1;
+    uint32_t sub = (uint32_t) (value >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (exp - SUB_BITS + 1) * SUB_BUCKETS + sub;
+  }
+
+  // lowest value of the bucket
+  static inline uint64_t lower(uint32_t idx) {
+    if (idx < SUB_BUCKETS)
+      return idx;
+    int exp = idx / SUB_BUCKETS + SUB_BITS - 1;
+    return (uint64_t) (SUB_BUCKETS + idx % SUB_BUCKETS) << (exp - SUB_BITS);
+  }
+
+  // value reported for the bucket, its middle
+  static inline uint64_t middle(uint32_t idx) {
+    if (idx < SUB_BUCKETS || idx == BUCKETS - 1)
+      return lower(idx);
+    return lower(idx) + (lower(idx + 1) - lower(idx)) / 2;
+  }
+
+  // lock-free, safe to be called by many threads
+  inline void record(uint64_t value) {
+    __sync_fetch_and_add(&counts[index(value)], 1);
+  }
+
+  void merge(const log_linear_histogram &other) {
+    for (int i = 0; i < BUCKETS; i++)
+      counts[i] += __atomic_load_n(&other.counts[i], __ATOMIC_RELAXED);
+  }
+
+  uint64_t total() const {
+    uint64_t n = 0;
+    for (int i = 0; i < BUCKETS; i++)
+      n += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+    return n;
+  }
+
+  // q in [0, 1], return 0 if histogram is empty
+  uint64_t quantile(double q, uint64_t total) const {
+    if (total == 0)
+      return 0;
+    uint64_t rank = (uint64_t) (q * total);
+    if (rank >= total)
+      rank = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      seen += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+      if (seen > rank)
+        return middle(i);
+    }
+    return middle(BUCKETS - 1);
+  }
+
+  uint64_t counts[BUCKETS];
+};
+
+#endif //_CHANNEL_HISTOGRAM_H
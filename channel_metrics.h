@@ -0,0 +1,185 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_METRICS_H
+#define _CHANNEL_METRICS_H
+
+#include <stdint.h>
+
+/*
+  Metric schema: each counter of a channel is declared once, as
+    X(field, name, prometheus_name, help, value)
+  - field: member of channel_block (an array by channel) and channel_stat
+  - name: key in json and binary output
+  - prometheus_name, help: of the Prometheus counter
+  - value: expression of txn_values t, added to the counter at txn close
+    if it's not 0
+  The counter layout, the txn update and all outputs are generated from
+  CHANNEL_METRICS, adding a metric is adding a line here.
+
+  Base metrics count GET txns only, as they always did. Status and method
+  metrics count txns of all methods, so with either of them non-GET txns
+  are hooked too and the method is looked up at txn close. A channel is
+  still created by a 2xx GET txn only, other txns count in existing
+  channels.
+  Groups of metrics can be compiled out, with their memory and txn work:
+  - CSTATS_NO_STATUS_METRICS: response.count.<class>
+  - CSTATS_NO_METHOD_METRICS: request.count.<method>
+  - CSTATS_NO_ORIGIN_METRICS: cache.* and origin.*, and the lookup of
+    cache result, origin bytes and milestones at txn close
+  Without the first two, only GET txns are hooked and t.method is a
+  constant.
+*/
+
+// http methods counted by method metrics
+enum txn_method {
+  METHOD_OTHER,
+  METHOD_GET,
+  METHOD_HEAD,
+  METHOD_POST,
+  METHOD_PUT,
+  METHOD_DELETE,
+  NUM_METHODS
+};
+
+// what metrics are computed from, for a txn
+struct txn_values {
+  int status_class; // 1 to 5
+  int method; // txn_method
+  uint64_t body_bytes;
+  uint64_t user_speed; // bytes per sec, 0 if unknown
+  // GET only, else cache_lookup is -1 and others 0
+  int cache_lookup; // TSCacheLookupResult, -1 if there was no lookup
+  uint64_t origin_bytes; // server response body bytes
+  int origin; // 1 if the txn went to origin
+  uint64_t origin_connect_us; // SERVER_CONNECT to SERVER_CONNECT_END
+  uint64_t origin_ttfb_us; // SERVER_BEGIN_WRITE to SERVER_FIRST_READ
+  uint64_t origin_total_us; // SERVER_CONNECT to SERVER_CLOSE
+};
+
+#define CHANNEL_METRICS_BASE(X) \
+  X(response_bytes_content, "response.bytes.content", \
+    "channel_stats_response_bytes_content_total", \
+    "Transferred content length, not including header", \
+    t.method == METHOD_GET ? t.body_bytes : 0) \
+  X(response_count_2xx, "response.count.2xx.get", \
+    "channel_stats_response_count_2xx_get_total", "2xx transaction count", \
+    t.method == METHOD_GET && t.status_class == 2) \
+  X(response_count_5xx, "response.count.5xx.get", \
+    "channel_stats_response_count_5xx_get_total", "5xx transaction count", \
+    t.method == METHOD_GET && t.status_class == 5) \
+  X(speed_ua_bytes_per_sec_64k, "speed.ua.bytes_per_sec_64k", \
+    "channel_stats_speed_ua_below_64k_total", \
+    "Count of transactions whose speed is < 64KBps", \
+    t.method == METHOD_GET && t.user_speed > 0 && t.user_speed < 64000)
+
+#ifndef CSTATS_NO_STATUS_METRICS
+#define CHANNEL_METRICS_STATUS(X) \
+  X(response_count_1xx_all, "response.count.1xx", \
+    "channel_stats_response_count_1xx_total", "1xx transaction count, all methods", \
+    t.status_class == 1) \
+  X(response_count_2xx_all, "response.count.2xx", \
+    "channel_stats_response_count_2xx_total", "2xx transaction count, all methods", \
+    t.status_class == 2) \
+  X(response_count_3xx_all, "response.count.3xx", \
+    "channel_stats_response_count_3xx_total", "3xx transaction count, all methods", \
+    t.status_class == 3) \
+  X(response_count_4xx_all, "response.count.4xx", \
+    "channel_stats_response_count_4xx_total", "4xx transaction count, all methods", \
+    t.status_class == 4) \
+  X(response_count_5xx_all, "response.count.5xx", \
+    "channel_stats_response_count_5xx_total", "5xx transaction count, all methods", \
+    t.status_class == 5)
+#else
+#define CHANNEL_METRICS_STATUS(X)
+#endif
+
+#ifndef CSTATS_NO_METHOD_METRICS
+#define CHANNEL_METRICS_METHOD(X) \
+  X(request_count_get, "request.count.get", \
+    "channel_stats_request_count_get_total", "GET transaction count", \
+    t.method == METHOD_GET) \
+  X(request_count_head, "request.count.head", \
+    "channel_stats_request_count_head_total", "HEAD transaction count", \
+    t.method == METHOD_HEAD) \
+  X(request_count_post, "request.count.post", \
+    "channel_stats_request_count_post_total", "POST transaction count", \
+    t.method == METHOD_POST) \
+  X(request_count_put, "request.count.put", \
+    "channel_stats_request_count_put_total", "PUT transaction count", \
+    t.method == METHOD_PUT) \
+  X(request_count_delete, "request.count.delete", \
+    "channel_stats_request_count_delete_total", "DELETE transaction count", \
+    t.method == METHOD_DELETE) \
+  X(request_count_other, "request.count.other", \
+    "channel_stats_request_count_other_total", "Transaction count of other methods", \
+    t.method == METHOD_OTHER)
+#else
+#define CHANNEL_METRICS_METHOD(X)
+#endif
+
+/*
+  Times are sums in us, their averages are divided by origin.count. With
+  keep-alive to origin, connect is ~0 for a reused connection.
+*/
+#ifndef CSTATS_NO_ORIGIN_METRICS
+#define CHANNEL_METRICS_ORIGIN(X) \
+  X(cache_hit_fresh, "cache.hit.fresh", \
+    "channel_stats_cache_hit_fresh_total", "Fresh cache hit count", \
+    t.cache_lookup == TS_CACHE_LOOKUP_HIT_FRESH) \
+  X(cache_hit_stale, "cache.hit.stale", \
+    "channel_stats_cache_hit_stale_total", "Stale cache hit count", \
+    t.cache_lookup == TS_CACHE_LOOKUP_HIT_STALE) \
+  X(cache_miss, "cache.miss", \
+    "channel_stats_cache_miss_total", "Cache miss count", \
+    t.cache_lookup == TS_CACHE_LOOKUP_MISS) \
+  X(cache_skipped, "cache.skipped", \
+    "channel_stats_cache_skipped_total", "Count of skipped cache lookups", \
+    t.cache_lookup == TS_CACHE_LOOKUP_SKIPPED) \
+  X(origin_bytes_content, "origin.bytes.content", \
+    "channel_stats_origin_bytes_content_total", \
+    "Content length read from origin, not including header", \
+    t.origin_bytes) \
+  X(origin_count, "origin.count", \
+    "channel_stats_origin_count_total", "Count of transactions to origin", \
+    t.origin) \
+  X(origin_connect_us, "origin.connect_us", \
+    "channel_stats_origin_connect_us_total", "Sum of origin connect times", \
+    t.origin_connect_us) \
+  X(origin_ttfb_us, "origin.ttfb_us", \
+    "channel_stats_origin_ttfb_us_total", \
+    "Sum of times from request write to first byte read from origin", \
+    t.origin_ttfb_us) \
+  X(origin_total_us, "origin.total_us", \
+    "channel_stats_origin_total_us_total", "Sum of origin transaction times", \
+    t.origin_total_us)
+#else
+#define CHANNEL_METRICS_ORIGIN(X)
+#endif
+
+#if !defined(CSTATS_NO_STATUS_METRICS) || !defined(CSTATS_NO_METHOD_METRICS)
+#define CSTATS_ALL_METHODS // txns of all methods are hooked
+#endif
+
+#define CHANNEL_METRICS(X) \
+  CHANNEL_METRICS_BASE(X) \
+  CHANNEL_METRICS_STATUS(X) \
+  CHANNEL_METRICS_METHOD(X) \
+  CHANNEL_METRICS_ORIGIN(X)
+
+#endif //_CHANNEL_METRICS_H
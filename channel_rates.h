@@ -0,0 +1,109 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_RATES_H
+#define _CHANNEL_RATES_H
+
+#include <stdint.h>
+
+/*
+  Sliding window counters: a ring of time buckets, each bucket is tagged
+  with its time unit number (e.g. second since epoch). There is no timer,
+  a writer finds its bucket by time and resets it when the tag is stale,
+  a reader only sums buckets whose tag is in the window.
+
+  The reset is not atomic with the adds of other writers to the same bucket
+  at the same moment, such an add may be lost, once per bucket per unit at
+  most. It's fine for rates.
+*/
+
+struct rate_bucket {
+  uint32_t tag;
+  uint32_t requests;
+  uint32_t count_5xx;
+  uint32_t reserved;
+  uint64_t bytes;
+};
+
+template<int N> // N must be power of 2
+struct rate_ring
+{
+  inline void add(uint32_t tag, uint64_t bytes, int is_5xx) {
+    rate_bucket *b = &buckets[tag & (N - 1)];
+    uint32_t old = __atomic_load_n(&b->tag, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(old != tag, 0)) {
+      if (tag < old)
+        return; // too late, bucket is reused by a later unit
+      if (__sync_bool_compare_and_swap(&b->tag, old, tag)) {
+        __atomic_store_n(&b->requests, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->count_5xx, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->bytes, 0, __ATOMIC_RELAXED);
+      }
+    }
+    __sync_fetch_and_add(&b->requests, 1);
+    if (is_5xx)
+      __sync_fetch_and_add(&b->count_5xx, 1);
+    if (bytes)
+      __sync_fetch_and_add(&b->bytes, bytes);
+  }
+
+  // add up buckets with tag in [from, to], to - from must be less than N
+  void sum(uint32_t from, uint32_t to, rate_bucket *total) const {
+    for (uint32_t tag = from; tag <= to; tag++) {
+      const rate_bucket *b = &buckets[tag & (N - 1)];
+      if (__atomic_load_n(&b->tag, __ATOMIC_ACQUIRE) != tag)
+        continue;
+      total->requests += __atomic_load_n(&b->requests, __ATOMIC_RELAXED);
+      total->count_5xx += __atomic_load_n(&b->count_5xx, __ATOMIC_RELAXED);
+      total->bytes += __atomic_load_n(&b->bytes, __ATOMIC_RELAXED);
+    }
+  }
+
+  rate_bucket buckets[N];
+};
+
+/*
+  Rates of a channel: 64 one-second buckets and 64 one-minute buckets,
+  windows are made of complete units only (the current one is excluded),
+  so up to 63 seconds and 63 minutes can be asked. Windows of up to 63
+  seconds slide by second, longer ones by minute.
+*/
+struct channel_rates
+{
+  enum { SECONDS = 64, MINUTES = 64 };
+
+  inline void add(uint32_t now, uint64_t bytes, int is_5xx) {
+    seconds.add(now, bytes, is_5xx);
+    minutes.add(now / 60, bytes, is_5xx);
+  }
+
+  // sum of last window seconds (< SECONDS) before now
+  void sum_seconds(uint32_t now, uint32_t window, rate_bucket *total) const {
+    seconds.sum(now - window, now - 1, total);
+  }
+
+  // sum of last window minutes (< MINUTES) before current minute
+  void sum_minutes(uint32_t now, uint32_t window, rate_bucket *total) const {
+    minutes.sum(now / 60 - window, now / 60 - 1, total);
+  }
+
+  rate_ring<SECONDS> seconds;
+  rate_ring<MINUTES> minutes;
+};
+
+#endif //_CHANNEL_RATES_H
@@ -0,0 +1,329 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_REGISTRY_H
+#define _CHANNEL_REGISTRY_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <sys/mman.h>
+
+#include "channel_metrics.h"
+
+/*
+  Channel registry: gives each channel a dense id (0, 1, 2, ...) and keeps
+  - names, interned in one arena, null-terminated
+  - counters, in blocks of CHANNEL_BLOCK_SIZE channels, each counter is an
+    array in the block (structure of arrays), indexed by id
+  All memory is reserved once by mmap for max channels and committed by the
+  kernel on first touch, so it never moves and costs nothing until used.
+  Counters (hot) and names (cold) are in separate pages.
+
+  add() must be serialized by the caller, other methods take no lock.
+  A channel is published by a release store of the count after its name
+  is written, so a reader never sees a half-added channel.
+
+  With reuse (enable_reuse(), for eviction), a channel can be retired and
+  its id given later to another channel. Each id then has a tag, even
+  while its channel is live and odd once it's retired, bumped on retire
+  and on reuse, so whoever holds an id and its tag can tell the channel is
+  gone. A name gets room for longer names, a reused id takes an id with
+  enough room and writes its name in place while the tag is odd, readers
+  check the tag after the name as a seqlock (has_name(), copy_name()).
+  Names are no longer in id order then, names() can't be used.
+*/
+
+typedef uint32_t channel_id;
+
+#define CHANNEL_ID_NONE ((channel_id) -1)
+#define CHANNEL_BLOCK_SIZE 1024 // channels per block, keep it power of 2
+#define CHANNEL_BLOCK_ALIGN 64 // cache line size
+#define CHANNEL_PAGE_SIZE 4096
+#define CHANNEL_NAME_ROOM 16 // names take a multiple of it with reuse
+#define CHANNEL_ROOM_CLASSES 32 // free lists of ids, by name room
+
+// counters of CHANNEL_BLOCK_SIZE channels, an array for each metric
+struct channel_block {
+#define CHANNEL_BLOCK_COUNTER(field, name, prometheus_name, help, value) \
+  uint64_t field[CHANNEL_BLOCK_SIZE];
+  CHANNEL_METRICS(CHANNEL_BLOCK_COUNTER)
+#undef CHANNEL_BLOCK_COUNTER
+} __attribute__((aligned(CHANNEL_BLOCK_ALIGN)));
+
+static inline size_t
+align_up(size_t size, size_t align)
+{
+  return (size + align - 1) & ~(align - 1);
+}
+
+// zeroed memory committed on first touch, NULL if failed
+static inline void *
+reserve_pages(size_t size)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+class channel_registry
+{
+public:
+  channel_registry()
+      : base_(NULL), base_size_(0), blocks_(NULL), names_(NULL),
+        arena_(NULL), arena_size_(0), arena_used_(0),
+        max_channels_(0), count_(0), reuse_(NULL), retired_(0) {
+  }
+
+  // bytes of memory for max_channels, names take arena_size bytes at most
+  static size_t memory_size(uint32_t max_channels, size_t arena_size) {
+    return blocks_size(max_channels) + names_size(max_channels) +
+           align_up(arena_size, CHANNEL_PAGE_SIZE);
+  }
+
+  // reserve memory for max_channels, names take arena_size bytes at most
+  bool init(uint32_t max_channels, size_t arena_size) {
+    void *base = reserve_pages(memory_size(max_channels, arena_size));
+    if (!base)
+      return false;
+    attach(base, max_channels, arena_size, 0);
+    return true;
+  }
+
+  /*
+    Use memory of memory_size() bytes, e.g. mapped from a file, which
+    already holds count channels of a registry with the same sizes.
+  */
+  void attach(void *base, uint32_t max_channels, size_t arena_size, uint32_t count) {
+    base_ = (char *) base;
+    base_size_ = memory_size(max_channels, arena_size);
+    blocks_ = (channel_block *) base_;
+    names_ = (name_ref *) (base_ + blocks_size(max_channels));
+    arena_ = base_ + blocks_size(max_channels) + names_size(max_channels);
+    arena_size_ = arena_size;
+    max_channels_ = max_channels;
+    count_ = count;
+    arena_used_ = count ? names_[count - 1].offset + names_[count - 1].len + 1 : 0;
+  }
+
+  // whether names of count channels fit in the arena, checks the last one
+  bool valid(uint32_t count) const {
+    if (count == 0)
+      return true;
+    if (count > max_channels_)
+      return false;
+    const name_ref &last = names_[count - 1];
+    return (size_t) last.offset + last.len + 1 <= arena_size_ &&
+           arena_[last.offset + last.len] == '\0';
+  }
+
+  // let ids be retired and reused, before any channel is added
+  bool enable_reuse() {
+    reuse_ = (id_reuse *) reserve_pages(align_up(max_channels_ * sizeof(id_reuse),
+                                                 CHANNEL_PAGE_SIZE));
+    return reuse_ != NULL;
+  }
+
+  /*
+    Add a channel, caller must hold the writer lock and make sure name isn't
+    added yet. Return its id, or CHANNEL_ID_NONE if registry is full.
+  */
+  channel_id add(const char *name, size_t len) {
+    channel_id id;
+
+    if (reuse_ && (id = take_free(len)) != CHANNEL_ID_NONE) {
+      char *p = arena_ + names_[id].offset;
+      memcpy(p, name, len);
+      p[len] = '\0';
+      __atomic_store_n(&names_[id].len, len, __ATOMIC_RELAXED); // read racily, see copy_name()
+      __atomic_store_n(&reuse_[id].tag, reuse_[id].tag + 1, __ATOMIC_RELEASE);
+      __atomic_store_n(&retired_, retired_ - 1, __ATOMIC_RELAXED);
+      return id;
+    }
+
+    size_t room = reuse_ ? align_up(len + 1, CHANNEL_NAME_ROOM) : len + 1;
+    id = count_;
+    if (id >= max_channels_ || arena_used_ + room > arena_size_)
+      return CHANNEL_ID_NONE;
+
+    memcpy(arena_ + arena_used_, name, len);
+    arena_[arena_used_ + len] = '\0';
+    names_[id].offset = arena_used_;
+    names_[id].len = len;
+    arena_used_ += room;
+    if (reuse_)
+      reuse_[id].room = room;
+
+    __atomic_store_n(&count_, id + 1, __ATOMIC_RELEASE);
+    return id;
+  }
+
+  /*
+    Retire a live channel, its tag becomes odd. Caller must hold the writer
+    lock, and call release() once no one can use the id with its old tag.
+  */
+  void retire(channel_id id) {
+    __atomic_store_n(&reuse_[id].tag, reuse_[id].tag + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&retired_, retired_ + 1, __ATOMIC_RELAXED);
+  }
+
+  // let a retired id be reused, caller must hold the writer lock
+  void release(channel_id id) {
+    free_[room_class(reuse_[id].room)].push_back(id);
+  }
+
+  // number of ids, live or retired, they are [0, size)
+  uint32_t size() const {
+    return __atomic_load_n(&count_, __ATOMIC_ACQUIRE);
+  }
+
+  // number of live channels
+  uint32_t live_size() const {
+    return size() - __atomic_load_n(&retired_, __ATOMIC_RELAXED);
+  }
+
+  uint32_t max_size() const {
+    return max_channels_;
+  }
+
+  // tag of a channel, see above, always 0 without reuse
+  uint32_t tag(channel_id id) const {
+    return reuse_ ? __atomic_load_n(&reuse_[id].tag, __ATOMIC_ACQUIRE) : 0;
+  }
+
+  static bool is_live(uint32_t tag) {
+    return (tag & 1) == 0;
+  }
+
+  // whether channel id with tag is live and named key
+  bool has_name(channel_id id, uint32_t tag, const char *key, size_t len) const {
+    size_t name_len;
+    const char *name = this->name(id, &name_len);
+
+    if (!is_live(tag) || name_len != len || memcmp(name, key, len) != 0)
+      return false;
+    return tag_is(id, tag);
+  }
+
+  /*
+    Copy the name of channel id with tag to buf of size bytes, null-
+    terminated, return its length, or 0 if it's not live or doesn't fit.
+  */
+  size_t copy_name(channel_id id, uint32_t tag, char *buf, size_t size) const {
+    size_t len;
+    const char *name = this->name(id, &len);
+
+    if (!is_live(tag) || len >= size)
+      return 0;
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    return tag_is(id, tag) ? len : 0;
+  }
+
+  // null-terminated name of a published channel, without reuse or holding
+  // the writer lock, else see copy_name()
+  const char *name(channel_id id, size_t *len) const {
+    *len = __atomic_load_n(&names_[id].len, __ATOMIC_RELAXED);
+    return arena_ + names_[id].offset;
+  }
+
+  // names of ids [0, count) as stored, null-terminated one after another
+  const char *names(uint32_t count, size_t *size) const {
+    *size = count ? names_[count - 1].offset + names_[count - 1].len + 1 : 0;
+    return arena_;
+  }
+
+  channel_block *block(channel_id id) const {
+    return &blocks_[id / CHANNEL_BLOCK_SIZE];
+  }
+
+  static uint32_t slot(channel_id id) {
+    return id % CHANNEL_BLOCK_SIZE;
+  }
+
+  size_t arena_used() const {
+    return arena_used_;
+  }
+
+private:
+  struct id_reuse {
+    uint32_t tag;
+    uint32_t room; // bytes of name room in arena
+  };
+
+  static uint32_t room_class(size_t room) {
+    return std::min(room / CHANNEL_NAME_ROOM, (size_t) CHANNEL_ROOM_CLASSES) - 1;
+  }
+
+  // a free id with room for a name of len, CHANNEL_ID_NONE if none
+  channel_id take_free(size_t len) {
+    size_t room = align_up(len + 1, CHANNEL_NAME_ROOM);
+    for (uint32_t c = room_class(room); c < CHANNEL_ROOM_CLASSES; c++) {
+      std::vector<channel_id> &ids = free_[c];
+      for (size_t i = ids.size(); i > 0; i--) {
+        channel_id id = ids[i - 1];
+        if (reuse_[id].room >= room) { // always but in the last class
+          ids[i - 1] = ids.back();
+          ids.pop_back();
+          return id;
+        }
+      }
+    }
+    return CHANNEL_ID_NONE;
+  }
+
+  // whether tag of id is still tag, after reading what it guards
+  bool tag_is(channel_id id, uint32_t tag) const {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return !reuse_ || __atomic_load_n(&reuse_[id].tag, __ATOMIC_RELAXED) == tag;
+  }
+
+  static size_t blocks_size(uint32_t max_channels) {
+    size_t num_blocks = (max_channels + CHANNEL_BLOCK_SIZE - 1) / CHANNEL_BLOCK_SIZE;
+    return align_up(num_blocks * sizeof(channel_block), CHANNEL_PAGE_SIZE);
+  }
+
+  static size_t names_size(uint32_t max_channels) {
+    return align_up(max_channels * sizeof(name_ref), CHANNEL_PAGE_SIZE);
+  }
+
+  struct name_ref {
+    uint32_t offset; // in arena
+    uint32_t len;
+  };
+
+  char *base_; // all memory
+  size_t base_size_;
+  channel_block *blocks_; // hot, counters
+  name_ref *names_; // cold, indexed by id
+  char *arena_; // cold, name strings
+  size_t arena_size_;
+  size_t arena_used_;
+  uint32_t max_channels_;
+  uint32_t count_;
+  id_reuse *reuse_; // by id, NULL without reuse
+  uint32_t retired_; // ids retired, not reused yet
+  std::vector<channel_id> free_[CHANNEL_ROOM_CLASSES]; // released ids by room
+
+  // not copyable
+  channel_registry(const channel_registry &);
+  channel_registry &operator=(const channel_registry &);
+};
+
+#endif //_CHANNEL_REGISTRY_H
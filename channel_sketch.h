@@ -0,0 +1,249 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_SKETCH_H
+#define _CHANNEL_SKETCH_H
+
+#include <stdint.h>
+#include <cstring>
+
+#include <ts/ts.h>
+
+/*
+  Space-Saving sketch (Metwally, Agrawal, El Abbadi, 2005): the heaviest
+  names of a stream in K counters. A name not counted yet takes the
+  counter of the least one, with its count as error, so for each counted
+  name count - error <= real weight <= count, and error <= total / K.
+  Any name whose real weight is more than total / K is counted.
+
+  Counters are in a min-heap of entry indexes (the least is replaced),
+  names are found by a private hash index of 64-bit name hashes.
+
+  add() must be called by one writer only (the owner thread), read() can
+  be called by any thread without lock: counts are atomic, an entry being
+  given to another name is marked by an odd seq and skipped.
+*/
+
+#define SKETCH_NAME_LEN 128 // longer names are truncated in output
+
+struct sketch_entry {
+  uint32_t seq; // odd while the entry changes name
+  uint32_t name_len;
+  uint64_t key; // hash of full name
+  uint64_t count; // >= real weight
+  uint64_t error; // max over-estimation of count
+  char name[SKETCH_NAME_LEN];
+};
+
+static inline uint64_t
+sketch_key(const char *name, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL; // 64-bit FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+class space_saving
+{
+public:
+  space_saving() : entries_(NULL), heap_(NULL), pos_(NULL), index_(NULL),
+      mask_(0), size_(0), used_(0), total_(0) {
+  }
+
+  void init(uint32_t size) {
+    size_t capacity = 16;
+    while (capacity < (size_t) size * 2)
+      capacity <<= 1;
+    entries_ = (sketch_entry *) TSmalloc(size * sizeof(sketch_entry));
+    heap_ = (uint32_t *) TSmalloc(size * sizeof(uint32_t));
+    pos_ = (uint32_t *) TSmalloc(size * sizeof(uint32_t));
+    index_ = (uint32_t *) TSmalloc(capacity * sizeof(uint32_t));
+    memset(entries_, 0, size * sizeof(sketch_entry));
+    memset(index_, 0, capacity * sizeof(uint32_t));
+    mask_ = capacity - 1;
+    size_ = size;
+  }
+
+  void add(const char *name, size_t len, uint64_t weight) {
+    uint64_t key = sketch_key(name, len);
+    uint32_t idx = find(key);
+
+    if (idx != NONE) {
+      set_count(idx, entries_[idx].count + weight);
+      sift_down(pos_[idx]);
+    } else if (used_ < size_) {
+      idx = used_;
+      assign(idx, key, name, len, weight, 0);
+      index_insert(key, idx);
+      heap_[idx] = idx;
+      pos_[idx] = idx;
+      __atomic_store_n(&used_, idx + 1, __ATOMIC_RELEASE);
+      sift_up(idx);
+    } else {
+      idx = heap_[0]; // least count
+      uint64_t least = entries_[idx].count;
+      index_erase(entries_[idx].key);
+      assign(idx, key, name, len, least + weight, least);
+      index_insert(key, idx);
+      sift_down(0);
+    }
+    __atomic_store_n(&total_, total_ + weight, __ATOMIC_RELAXED);
+  }
+
+  // copy counted entries to out (size() entries at most), return the number
+  uint32_t read(sketch_entry *out) const {
+    uint32_t used = __atomic_load_n(&used_, __ATOMIC_ACQUIRE);
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < used; i++) {
+      const sketch_entry *e = &entries_[i];
+      uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+        continue; // changing name, it's a least entry anyway
+      out[n].key = e->key;
+      out[n].name_len = e->name_len;
+      memcpy(out[n].name, e->name, sizeof(e->name));
+      out[n].count = __atomic_load_n(&e->count, __ATOMIC_RELAXED);
+      out[n].error = __atomic_load_n(&e->error, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq)
+        n++;
+    }
+    return n;
+  }
+
+  // weight of a name which isn't counted is at most this
+  uint64_t least() const {
+    if (__atomic_load_n(&used_, __ATOMIC_ACQUIRE) < size_)
+      return 0;
+    return __atomic_load_n(&entries_[__atomic_load_n(&heap_[0], __ATOMIC_RELAXED)].count,
+                           __ATOMIC_RELAXED);
+  }
+
+  uint64_t total() const {
+    return __atomic_load_n(&total_, __ATOMIC_RELAXED);
+  }
+
+  uint32_t size() const {
+    return size_;
+  }
+
+private:
+  enum { NONE = 0xffffffff };
+
+  void set_count(uint32_t idx, uint64_t count) {
+    __atomic_store_n(&entries_[idx].count, count, __ATOMIC_RELAXED);
+  }
+
+  void assign(uint32_t idx, uint64_t key, const char *name, size_t len,
+              uint64_t count, uint64_t error) {
+    sketch_entry *e = &entries_[idx];
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (len > SKETCH_NAME_LEN)
+      len = SKETCH_NAME_LEN;
+    e->key = key;
+    e->name_len = len;
+    memcpy(e->name, name, len);
+    set_count(idx, count);
+    __atomic_store_n(&e->error, error, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+  }
+
+  uint32_t find(uint64_t key) const {
+    for (size_t i = key & mask_; index_[i]; i = (i + 1) & mask_) {
+      if (entries_[index_[i] - 1].key == key)
+        return index_[i] - 1;
+    }
+    return NONE;
+  }
+
+  void index_insert(uint64_t key, uint32_t idx) {
+    size_t i = key & mask_;
+    while (index_[i])
+      i = (i + 1) & mask_;
+    index_[i] = idx + 1;
+  }
+
+  // linear probing delete: move back later items of the probe sequence
+  void index_erase(uint64_t key) {
+    size_t i = key & mask_;
+    while (entries_[index_[i] - 1].key != key)
+      i = (i + 1) & mask_;
+    for (size_t j = (i + 1) & mask_; index_[j]; j = (j + 1) & mask_) {
+      size_t home = entries_[index_[j] - 1].key & mask_;
+      // keep it if its home is cyclically in (i, j]
+      if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+        continue;
+      index_[i] = index_[j];
+      i = j;
+    }
+    index_[i] = 0;
+  }
+
+  uint64_t heap_count(uint32_t p) const {
+    return entries_[heap_[p]].count;
+  }
+
+  void heap_swap(uint32_t a, uint32_t b) {
+    uint32_t t = heap_[a];
+    heap_[a] = heap_[b];
+    heap_[b] = t;
+    pos_[heap_[a]] = a;
+    pos_[heap_[b]] = b;
+  }
+
+  void sift_up(uint32_t p) {
+    while (p > 0 && heap_count(p) < heap_count((p - 1) / 2)) {
+      heap_swap(p, (p - 1) / 2);
+      p = (p - 1) / 2;
+    }
+  }
+
+  void sift_down(uint32_t p) {
+    for (;;) {
+      uint32_t least = p, l = 2 * p + 1, r = l + 1;
+      if (l < used_ && heap_count(l) < heap_count(least))
+        least = l;
+      if (r < used_ && heap_count(r) < heap_count(least))
+        least = r;
+      if (least == p)
+        return;
+      heap_swap(p, least);
+      p = least;
+    }
+  }
+
+  sketch_entry *entries_;
+  uint32_t *heap_; // entry indexes, min-heap by count
+  uint32_t *pos_; // heap position of each entry
+  uint32_t *index_; // key -> entry index + 1, 0 is empty
+  size_t mask_;
+  uint32_t size_;
+  uint32_t used_;
+  uint64_t total_;
+
+  // not copyable
+  space_saving(const space_saving &);
+  space_saving &operator=(const space_saving &);
+};
+
+#endif //_CHANNEL_SKETCH_H
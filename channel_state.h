@@ -0,0 +1,109 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_STATE_H
+#define _CHANNEL_STATE_H
+
+#include <stdint.h>
+#include <cstddef>
+
+#include "channel_metrics.h"
+
+/*
+  State file (--state-file): the memory of the registry (counters and
+  names), of the channel hash table and the global stats is a shared
+  mapping of the file, so it's the state of the file itself and a
+  restart attaches it back without reading it.
+
+  Layout: the header, in the first CSTATS_STATE_HEADER_SIZE bytes, then
+  registry memory, then hash table memory. The layout fields of the
+  header, with a hash of the metrics of the build, are covered by a
+  checksum, a file of another version, layout or metrics is not
+  attached: counters of a build with other metrics would be read under
+  the wrong names even if they had the same size.
+
+  There is no write to make consistent after a crash: counters are 64-bit
+  words, a channel is counted in count after its name is written, and in
+  indexed after it's in hash table, so channels in [indexed, count) are
+  inserted again on attach.
+*/
+
+#define CSTATS_STATE_MAGIC "CSTS"
+#define CSTATS_STATE_VERSION 2
+#define CSTATS_STATE_HEADER_SIZE 4096
+
+// global stats, in the header of state file with --state-file
+struct global_stats {
+  uint64_t response_count_2xx_get; // 2XX GET response count
+  uint64_t response_bytes_content; // transferred bytes
+  uint64_t generation; // of api outputs, for delta output
+};
+
+struct cstats_state_header {
+  char magic[4]; // CSTATS_STATE_MAGIC, not null-terminated
+  uint32_t version; // CSTATS_STATE_VERSION
+  // layout
+  uint32_t max_channels;
+  uint32_t block_size; // CHANNEL_BLOCK_SIZE
+  uint64_t block_bytes; // sizeof(channel_block)
+  uint64_t arena_size;
+  uint64_t registry_size;
+  uint64_t hash_size;
+  uint64_t metrics_hash; // cstats_state_metrics_hash()
+  uint64_t checksum; // of the fields above
+  // updated while running
+  uint32_t count; // channels in registry
+  uint32_t indexed; // channels in hash table
+  global_stats globals;
+};
+
+// 64-bit FNV-1a of the counter fields of CHANNEL_METRICS, in order
+static inline uint64_t
+cstats_state_metrics_hash()
+{
+  static const char *const fields[] = {
+#define CSTATS_STATE_FIELD(field, name, prometheus_name, help, value) #field,
+    CHANNEL_METRICS(CSTATS_STATE_FIELD)
+#undef CSTATS_STATE_FIELD
+  };
+  uint64_t sum = 14695981039346656037ULL;
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    for (const char *p = fields[i]; ; p++) { // with the '\0', a separator
+      sum ^= (unsigned char) *p;
+      sum *= 1099511628211ULL;
+      if (*p == '\0')
+        break;
+    }
+  }
+  return sum;
+}
+
+// 64-bit FNV-1a of the header fields before checksum
+static inline uint64_t
+cstats_state_checksum(const cstats_state_header *h)
+{
+  const unsigned char *p = (const unsigned char *) h;
+  uint64_t sum = 14695981039346656037ULL;
+  for (size_t i = 0; i < offsetof(cstats_state_header, checksum); i++) {
+    sum ^= p[i];
+    sum *= 1099511628211ULL;
+  }
+  return sum;
+}
+
+#endif //_CHANNEL_STATE_H
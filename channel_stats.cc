@@ -23,11 +23,20 @@
 #include <cstring>
 #include <cctype>
 #include <string>
-#include <map> // may optimize by using hash_map, but mind compiler portability
+#include <map>
+#include <deque>
 #include <vector>
 #include <algorithm>
-#include <sstream>
+#include <cstdlib>
+#include <cerrno>
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <ts/ts.h>
 #if (TS_VERSION_NUMBER < 3003001)
@@ -36,9 +45,18 @@
 #endif
 
 #include "debug_macros.h"
+#include "channel_registry.h"
+#include "channel_hash.h"
+#include "channel_histogram.h"
+#include "channel_rates.h"
+#include "channel_stats_bin.h"
+#include "channel_sketch.h"
+#include "channel_filter.h"
+#include "channel_state.h"
+#include "channel_stats_shm.h"
 
 #define PLUGIN_NAME     "channel_stats"
-#define PLUGIN_VERSION  "0.2"
+#define PLUGIN_VERSION  "0.3"
 
 #define MAX_SPEED 999999999
 
@@ -46,725 +64,3735 @@
    regex_map rule can also generate infinite channels (hosts) */
 #define MAX_MAP_SIZE 100000
 
+// max length of "host:port", a domain name has at most 253 characters
+#define MAX_HOST_LEN 272
+
 static std::string api_path("_cstats");
 
-// global stats
-static uint64_t global_response_count_2xx_get = 0;  // 2XX GET response count
-static uint64_t global_response_bytes_content = 0;  // transferred bytes
+// global stats, in state file with --state-file
+static global_stats local_globals = {0, 0, 1};
+static global_stats *globals = &local_globals;
 
-// channel stats
+// stat of one channel, summed up from counters when stats are output,
+// a member for each metric of channel_metrics.h
 struct channel_stat {
-  channel_stat()
-      : response_bytes_content(0),
-        response_count_2xx(0),
-        response_count_5xx(0),
-        speed_ua_bytes_per_sec_64k(0) {
-  }
-
-  inline void increment(uint64_t rbc, uint64_t rc2,
-                        uint64_t rc5, uint64_t sbps6) {
-    if (rbc) __sync_fetch_and_add(&response_bytes_content, rbc);
-    if (rc2) __sync_fetch_and_add(&response_count_2xx, rc2);
-    if (rc5) __sync_fetch_and_add(&response_count_5xx, rc5);
-    if (sbps6) __sync_fetch_and_add(&speed_ua_bytes_per_sec_64k, sbps6);
+  channel_stat() {
+#define X(field, name, prometheus_name, help, value) field = 0;
+    CHANNEL_METRICS(X)
+#undef X
   }
 
   inline void debug_channel() {
-    debug("response.bytes.content: %" PRIu64 "", response_bytes_content);
-    debug("response.count.2xx: %" PRIu64 "", response_count_2xx);
-    debug("response.count.5xx: %" PRIu64 "", response_count_5xx);
-    debug("speed.ua.bytes_per_sec_64k: %" PRIu64 "", speed_ua_bytes_per_sec_64k);
+#define X(field, name, prometheus_name, help, value) \
+    debug(name ": %" PRIu64 "", field);
+    CHANNEL_METRICS(X)
+#undef X
   }
 
-  uint64_t response_bytes_content;
-  uint64_t response_count_2xx;
-  uint64_t response_count_5xx;
-  uint64_t speed_ua_bytes_per_sec_64k;
+#define X(field, name, prometheus_name, help, value) uint64_t field;
+  CHANNEL_METRICS(X)
+#undef X
 };
 
-typedef std::map<std::string, channel_stat *> stats_map_t;
-typedef stats_map_t::iterator smap_iterator;
+/* latency histograms of a channel (--histograms)
+   - duration: txn duration in ms, from UA_BEGIN to UA_CLOSE, up to ~70min
+   - speed: client speed in KB/s, up to 32GB/s
+   4 buckets per power of 2, quantiles are within 12.5%, ~1.4KB each channel */
+typedef log_linear_histogram<2, 22> duration_histogram;
+typedef log_linear_histogram<2, 24> speed_histogram;
 
-static stats_map_t channel_stats;
-static TSMutex stats_map_mutex;
+struct channel_histograms {
+  duration_histogram duration;
+  speed_histogram speed;
+};
 
-// api Intercept Data
-typedef struct intercept_state_t
-{
-  TSVConn net_vc;
-  TSVIO read_vio;
-  TSVIO write_vio;
+static bool enable_histograms = false;
+static channel_histograms *histograms = NULL; // indexed by channel id
 
-  TSIOBuffer req_buffer;
-  TSIOBuffer resp_buffer;
-  TSIOBufferReader resp_reader;
+static const struct {
+  const char *name;
+  double q;
+} quantiles[] = {
+  {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}
+};
 
-  int output_bytes;
-  int body_written;
+// sliding window rates of channels (--rates), indexed by channel id
+static bool enable_rates = false;
+static channel_rates *rates = NULL;
 
-  int show_global; // default 0
-  char * channel; // default ""
-  int topn; // default -1
-  int deny; // default 0
-} intercept_state;
+static const struct {
+  const char *name;
+  uint32_t seconds; // window in seconds, < SECONDS or multiple of 60
+} rate_windows[] = {
+  {"1s", 1}, {"10s", 10}, {"60s", 60}, {"5m", 300}
+};
 
-struct private_seg_t {
-  struct in_addr net;
-  struct in_addr mask;
+/* generations, for delta output (?since=<generation>): an api output
+   bumps the generation before it reads counters and returns the new one,
+   a txn marks its channel with the generation after it adds to counters.
+   With since=g, channels whose mark is >= g are output. A channel is
+   also marked when it's added, and at post remap with eviction, which
+   takes channels whose mark is old as idle, see evict_sweep().
+   The fences on both sides make sure that an output which misses the
+   counts of a txn has bumped the generation before the txn reads it, so
+   the channel is in the next delta, which never misses a change.
+   The generation is globals->generation, it starts at 1. */
+static uint64_t *channel_generations = NULL; // indexed by channel id
+
+static inline void
+mark_channel_generation(channel_id id)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  uint64_t gen = __atomic_load_n(&globals->generation, __ATOMIC_RELAXED);
+  uint64_t mark = __atomic_load_n(&channel_generations[id], __ATOMIC_RELAXED);
+
+  // usually a load only, written once per generation, never decreased
+  while (mark < gen &&
+         !__atomic_compare_exchange_n(&channel_generations[id], &mark, gen, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+// average length of channel names to reserve arena for MAX_MAP_SIZE channels
+#define AVG_HOST_LEN 64
+
+// ids, names and shared counters of channels
+static channel_registry registry;
+
+/* counters update mode
+   - COUNTERS_ATOMIC: all threads add to the shared counters atomically
+   - COUNTERS_SHARDED: each thread adds to its own shard without atomic
+     operation, shards are summed when stats are output
+   - COUNTERS_EPOCH: as sharded, and shards are folded into consistent
+     views which outputs read, see counters_view */
+enum counters_type_t { COUNTERS_ATOMIC, COUNTERS_SHARDED, COUNTERS_EPOCH };
+static counters_type_t counters_type = COUNTERS_ATOMIC;
+
+#define CACHE_LINE_SIZE 64
+#define MAX_SHARDS 256 // threads beyond it fall back to atomic counters
+#define SHARD_BLOCKS ((MAX_MAP_SIZE + CHANNEL_BLOCK_SIZE - 1) / CHANNEL_BLOCK_SIZE)
+
+// counters of a shard, blocks have the same layout as in registry
+struct shard_counters {
+  uint64_t global_response_count_2xx_get;
+  uint64_t global_response_bytes_content;
+  channel_block *blocks[SHARD_BLOCKS];
 };
 
-// don't put inet_addr("255.255.255.255"), see BUGS in 'man 3 inet_addr'
-static struct private_seg_t private_segs[] = {
-  {{inet_addr("10.0.0.0")}, {inet_addr("255.0.0.0")}},
-  {{inet_addr("127.0.0.0")}, {inet_addr("255.0.0.0")}},
-  {{inet_addr("172.16.0.0")}, {inet_addr("255.240.0.0")}},
-  {{inet_addr("192.168.0.0")}, {inet_addr("255.255.0.0")}}
+/* Shard of one thread. Only the owner thread writes it and allocates its
+   blocks lazily, all memory of a shard is cache line aligned, so that
+   threads never write a same cache line. Sharded counters only use
+   sides[0]; epoch counters write the side of the current epoch. With
+   epoch counters or eviction, seq is odd while a txn is counted, and a
+   thread has a shard for it even with atomic counters. */
+struct stat_shard {
+  shard_counters sides[2];
+  uint32_t seq;
 };
-static int num_private_segs = sizeof(private_segs) / sizeof(private_seg_t);
 
-// all parameters are in network byte order
-static int
-is_in_net (const struct in_addr * addr,
-           const struct in_addr * netaddr,
-           const struct in_addr * netmask)
+static stat_shard *shards[MAX_SHARDS];
+static int num_shards = 0;
+static uint32_t unsharded_counting = 0; // txns counted by threads without shard
+static __thread stat_shard *thread_shard = NULL;
+static __thread bool thread_shard_failed = false;
+
+static void *
+cache_line_alloc(size_t size)
 {
-   if ((addr->s_addr & netmask->s_addr) == (netaddr->s_addr & netmask->s_addr))
-      return 1;
-   return 0;
+  void *p = NULL;
+  size = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+  if (posix_memalign(&p, CACHE_LINE_SIZE, size) != 0)
+    return NULL;
+  memset(p, 0, size);
+  return p;
 }
 
-static int
-is_private_ip(const struct in_addr * addr)
+// add without lock prefix, only for counters with single writer
+static inline void
+relaxed_add(uint64_t *counter, uint64_t value)
 {
-  int i;
-  for (i = 0; i < num_private_segs; i++) {
-    if (is_in_net(addr, &private_segs[i].net, &private_segs[i].mask))
-      return 1;
-  }
-  return 0;
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                   __ATOMIC_RELAXED);
 }
 
-static int handle_event(TSCont contp, TSEvent event, void *edata);
-static int api_handle_event(TSCont contp, TSEvent event, void *edata);
-
-/*
-  Get the value of parameter in url querystring
-  Return 0 and a null string if not find the parameter.
-  Return 1 and a value string, normally
-  Return 2 and a max_length value string if the length of the value exceeds.
-
-  Possible appearance: ?param=value&fake_param=value&param=value
-*/
-static int
-get_query_param(const char *query, const char *param,
-                char *result, int max_length)
+static inline uint64_t
+relaxed_load(const uint64_t *counter)
 {
-  const char *pos = 0;
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
 
-  pos = strstr(query, param); // try to find in querystring of url
-  if (pos != query) {
-    // if param is not prefix of querystring
-    while (pos && *(pos - 1) != '&') { // param must be after '&'
-        pos = strstr(pos + strlen(param), param); // try next
-    }
+// return NULL if current thread can't own a shard
+static stat_shard *
+get_thread_shard()
+{
+  if (likely(thread_shard != NULL))
+    return thread_shard;
+  if (thread_shard_failed)
+    return NULL;
+
+  int idx = __sync_fetch_and_add(&num_shards, 1);
+  stat_shard *shard = NULL;
+  if (idx < MAX_SHARDS)
+    shard = (stat_shard *) cache_line_alloc(sizeof(stat_shard));
+  if (!shard) {
+    warning("no shard for this thread, fall back to atomic counters");
+    thread_shard_failed = true;
+    return NULL;
   }
 
-  if (!pos) {
-    // set it null string if not found
-    result[0] = '\0';
-    return 0;
+  __atomic_store_n(&shards[idx], shard, __ATOMIC_RELEASE);
+  thread_shard = shard;
+  debug("new shard #%d", idx);
+  return shard;
+}
+
+static channel_block *
+get_shard_block(shard_counters *side, channel_id id)
+{
+  channel_block *block = side->blocks[id / CHANNEL_BLOCK_SIZE];
+  if (unlikely(block == NULL)) {
+    block = (channel_block *) cache_line_alloc(sizeof(channel_block));
+    if (!block)
+      return NULL;
+    __atomic_store_n(&side->blocks[id / CHANNEL_BLOCK_SIZE], block, __ATOMIC_RELEASE);
   }
+  return block;
+}
 
-  pos += strlen(param); // skip 'param='
+static inline int
+get_num_shards()
+{
+  int n = __atomic_load_n(&num_shards, __ATOMIC_ACQUIRE);
+  return n < MAX_SHARDS ? n : MAX_SHARDS;
+}
 
-  // copy value of param
-  int now = 0;
-  while (*pos != '\0' && *pos != '&' && now < max_length) {
-    result[now++] = *pos;
-    pos++;
-  }
-  result[now] = '\0'; // make sure null-terminated
+/* eviction (--evict-idle=MIN): channels without txn for MIN minutes are
+   removed every EVICT_SWEEP_INTERVAL, see evict_sweep(). Their counters
+   are added to evicted_stat, so are txns of a channel evicted while they
+   ran, and their ids are given to new channels. */
+#define EVICT_SWEEP_INTERVAL 60 // seconds
 
-  if (*pos != '\0' && *pos != '&' && now == max_length)
-    return 2;
-  else
-    return 1;
+static int evict_idle = 0; // seconds, 0 means no eviction
+static channel_stat evicted_stat;
+static uint64_t evicted_channels = 0;
+static uint32_t evict_next_sweep = 0; // epoch counters: time of next sweep, in s
+
+static void
+add_evicted_stat(const channel_stat &stat)
+{
+#define X(field, name, prometheus_name, help, value) \
+  if (stat.field) \
+    __sync_fetch_and_add(&evicted_stat.field, stat.field);
+  CHANNEL_METRICS(X)
+#undef X
 }
 
-/*
-  check if exist param in query string
+// add a txn of an evicted channel
+static void
+add_evicted_txn(const txn_values &t)
+{
+  uint64_t v;
+#define X(field, name, prometheus_name, help, value) \
+  if ((v = (value)) != 0) \
+    __sync_fetch_and_add(&evicted_stat.field, v);
+  CHANNEL_METRICS(X)
+#undef X
+}
 
-  Possible querystring: ?param1=value1&param2
-  (param2 is a param which "has_no_value")
-*/
-static int
-has_query_param(const char *query, const char *param, int has_no_value)
+/* Epoch counters (--counters=epoch): outputs read a view, a sum of all
+   counters and globals at a point in time, so the values of an output are
+   consistent with each other, while txns are still counted without lock
+   or wait.
+   - each thread counts in its shard, in the side of the current epoch
+   - every --epoch-interval, the epoch task bumps the epoch, waits for the
+     txn being counted by each thread, if any, then builds the next view:
+     the current one plus the sides of the previous epoch, which it zeroes
+   - an output holds its view from start to end; views are refcounted and
+     a released one is kept to build the next one
+   A view is up to an interval late. Histograms, rates and heavy hitters
+   are not in views. Threads without shard count in shared counters, which
+   are folded counter by counter, without consistency. */
+struct counters_view {
+  int refcount; // guarded by view_mutex, 1 while it's current
+  channel_id count;
+  channel_id live; // channels not evicted
+  uint64_t generation; // bumped before the epoch, see epoch_fold()
+  uint64_t response_count_2xx_get;
+  uint64_t response_bytes_content;
+  channel_stat evicted;
+  uint64_t evicted_channels;
+  channel_block *blocks[SHARD_BLOCKS]; // NULL if all counters are 0
+};
+
+static int epoch_interval = 1000; // ms
+static uint32_t counters_epoch = 0; // threads count in side counters_epoch & 1
+static bool epoch_shared_used = false; // some txn is in shared counters
+static TSMutex view_mutex;
+static counters_view *current_view = NULL; // guarded by view_mutex
+static counters_view *spare_view = NULL; // guarded by view_mutex
+
+// start counting a txn, before the epoch or the tag of its channel is read
+static inline void
+shard_enter(stat_shard *shard)
 {
-  const char *pos = 0;
+  __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 
-  pos = strstr(query, param); // try to find in querystring of url
-  if (pos != query) {
-    // if param is not prefix of querystring
-    while (pos && *(pos - 1) != '&') { // param must be after '&'
-        pos = strstr(pos + strlen(param), param); // try next
-    }
+static inline void
+shard_leave(stat_shard *shard)
+{
+  __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+// wait for txns being counted by other threads, a few ns each
+static void
+wait_counting_txns()
+{
+  int n = get_num_shards();
+  for (int s = 0; s < n; s++) {
+    stat_shard *shard = __atomic_load_n(&shards[s], __ATOMIC_ACQUIRE);
+    if (!shard)
+      continue;
+    uint32_t seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+    while ((seq & 1) && __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE) == seq)
+      sched_yield();
   }
+  while (__atomic_load_n(&unsharded_counting, __ATOMIC_ACQUIRE) != 0)
+    sched_yield();
+}
 
-  if (!pos)
-    return 0;
+static counters_view *
+view_acquire()
+{
+  counters_view *view;
+
+  TSMutexLock(view_mutex);
+  view = current_view;
+  view->refcount++;
+  TSMutexUnlock(view_mutex);
+  return view;
+}
 
-  pos += strlen(param); // skip 'param='
+static void
+view_free(counters_view *view)
+{
+  for (int b = 0; b < SHARD_BLOCKS; b++)
+    free(view->blocks[b]);
+  free(view);
+}
 
-  if (has_no_value) {
-    if (*pos == '\0' || *pos == '&') return 1;
-  } else {
-    if (*pos == '=') return 1;
+// the first released view is kept as spare, for the next fold
+static void
+view_release(counters_view *view)
+{
+  counters_view *drop = NULL;
+
+  TSMutexLock(view_mutex);
+  if (--view->refcount == 0) {
+    if (!spare_view)
+      spare_view = view;
+    else
+      drop = view;
   }
+  TSMutexUnlock(view_mutex);
+  if (drop)
+    view_free(drop);
+}
 
-  return 0;
+static inline const channel_block *
+view_block(const counters_view *view, channel_id id)
+{
+  return id < view->count ? view->blocks[id / CHANNEL_BLOCK_SIZE] : NULL;
+}
+
+static inline void
+add_block_stat(const channel_block *block, uint32_t i, channel_stat *sum)
+{
+#define X(field, name, prometheus_name, help, value) \
+  sum->field += relaxed_load(&block->field[i]);
+  CHANNEL_METRICS(X)
+#undef X
+}
+
+// add a txn to counters of a channel, atomically or by the only writer
+template<bool ATOMIC>
+static inline void
+add_block_txn(channel_block *block, uint32_t i, const txn_values &t)
+{
+  uint64_t v;
+#define X(field, name, prometheus_name, help, value) \
+  if ((v = (value)) != 0) { \
+    if (ATOMIC) \
+      __sync_fetch_and_add(&block->field[i], v); \
+    else \
+      relaxed_add(&block->field[i], v); \
+  }
+  CHANNEL_METRICS(X)
+#undef X
 }
 
+// sum up shared counters and all shards of the channel, or read it in view
 static void
-get_api_params(TSMBuffer   bufp,
-               TSMLoc      url_loc,
-               int *       show_global,
-               char **     channel,
-               int *       topn)
+read_channel_stat(const counters_view *view, channel_id id, channel_stat *sum)
 {
-  const char * query; // not null-terminated, get from TS api
-  char * tmp_query = NULL; // null-terminated
-  int query_len = 0;
+  uint32_t i = channel_registry::slot(id);
 
-  *show_global = 0;
-  *topn = -1;
+  *sum = channel_stat();
+  if (view) {
+    const channel_block *block = view_block(view, id);
+    if (block)
+      add_block_stat(block, i, sum);
+    return;
+  }
+  add_block_stat(registry.block(id), i, sum);
 
-  query = TSUrlHttpQueryGet(bufp, url_loc, &query_len);
-  if (query_len == 0)
+  if (counters_type != COUNTERS_SHARDED)
     return;
-  tmp_query = TSstrndup(query, query_len);
-  debug_api("querystring: %s", tmp_query);
 
-  if (has_query_param(tmp_query, "global", 1)) {
-    debug_api("found 'global' param");
-    *show_global = 1;
+  int n = get_num_shards();
+  for (int s = 0; s < n; s++) {
+    stat_shard *shard = __atomic_load_n(&shards[s], __ATOMIC_ACQUIRE);
+    if (!shard)
+      continue;
+    channel_block *block = __atomic_load_n(&shard->sides[0].blocks[id / CHANNEL_BLOCK_SIZE],
+                                           __ATOMIC_ACQUIRE);
+    if (block)
+      add_block_stat(block, i, sum);
   }
+}
 
-  *channel = (char *) TSmalloc(query_len);
-  if (get_query_param(tmp_query, "channel=", *channel, query_len)) {
-    debug_api("found 'channel' param: %s", *channel);
-  }
+// one counter column of channel_block, e.g. &channel_block::response_count_2xx
+typedef uint64_t (channel_block::*channel_column)[CHANNEL_BLOCK_SIZE];
+
+// metrics of channel_metrics.h, in order, for outputs
+static const struct {
+  const char *name;
+  const char *prometheus_name;
+  const char *help;
+  channel_column column;
+  uint64_t channel_stat::*field; // same counter, summed up in top list
+} channel_metrics[] = {
+#define X(field, name, prometheus_name, help, value) \
+  {name, prometheus_name, help, &channel_block::field, &channel_stat::field},
+  CHANNEL_METRICS(X)
+#undef X
+};
+#define NUM_CHANNEL_METRICS ((int) (sizeof(channel_metrics) / sizeof(channel_metrics[0])))
 
-  std::stringstream ss;
-  char * tmp_topn = (char *) TSmalloc(query_len);
-  if (get_query_param(tmp_query, "topn=", tmp_topn, 10)) {
-    if (strlen(tmp_topn) > 0) {
-      ss.str(tmp_topn);
-      ss >> *topn;
-    }
-    debug_api("found 'topn' param: %d", *topn);
+// sum up one counter of the channel, as read_channel_stat() does for all
+static uint64_t
+read_channel_counter(const counters_view *view, channel_id id, channel_column column)
+{
+  uint32_t i = channel_registry::slot(id);
+
+  if (view) {
+    const channel_block *block = view_block(view, id);
+    return block ? (block->*column)[i] : 0;
   }
 
-  TSfree(tmp_query);
-  TSfree(tmp_topn);
+  uint64_t sum = relaxed_load(&(registry.block(id)->*column)[i]);
+  if (counters_type != COUNTERS_SHARDED)
+    return sum;
+
+  int n = get_num_shards();
+  for (int s = 0; s < n; s++) {
+    stat_shard *shard = __atomic_load_n(&shards[s], __ATOMIC_ACQUIRE);
+    if (!shard)
+      continue;
+    channel_block *block = __atomic_load_n(&shard->sides[0].blocks[id / CHANNEL_BLOCK_SIZE],
+                                           __ATOMIC_ACQUIRE);
+    if (block)
+      sum += relaxed_load(&(block->*column)[i]);
+  }
+  return sum;
 }
 
+// sum up one counter of channels [first, first + n), all in one block
 static void
-handle_read_req(TSCont contp, TSHttpTxn txnp)
+read_channel_counters(const counters_view *view, channel_id first, uint32_t n,
+                      channel_column column, uint64_t *sums)
 {
-  TSMBuffer bufp;
-  TSMLoc hdr_loc = NULL;
-  TSMLoc url_loc = NULL;
-  const char *method;
-  int method_length = 0;
-  TSCont txn_contp;
+  uint32_t i = channel_registry::slot(first);
+  const uint64_t *counters;
+
+  if (view) {
+    const channel_block *block = view_block(view, first);
+    if (block)
+      memcpy(sums, &(block->*column)[i], n * sizeof(uint64_t));
+    else
+      memset(sums, 0, n * sizeof(uint64_t));
+    return;
+  }
 
-  const char * path;
-  int path_len;
-  struct sockaddr * client_addr;
-  struct sockaddr_in * client_addr4;
-  TSCont api_contp;
-  char * client_ip;
-  intercept_state *api_state;
+  counters = &(registry.block(first)->*column)[i];
+  for (uint32_t k = 0; k < n; k++)
+    sums[k] = relaxed_load(&counters[k]);
 
-  if (TSHttpTxnClientReqGet(txnp, &bufp, &hdr_loc) != TS_SUCCESS) {
-    error("couldn't retrieve client's request");
-    goto cleanup;
+  if (counters_type != COUNTERS_SHARDED)
+    return;
+
+  int num = get_num_shards();
+  for (int s = 0; s < num; s++) {
+    stat_shard *shard = __atomic_load_n(&shards[s], __ATOMIC_ACQUIRE);
+    if (!shard)
+      continue;
+    channel_block *block = __atomic_load_n(&shard->sides[0].blocks[first / CHANNEL_BLOCK_SIZE],
+                                           __ATOMIC_ACQUIRE);
+    if (!block)
+      continue;
+    counters = &(block->*column)[i];
+    for (uint32_t k = 0; k < n; k++)
+      sums[k] += relaxed_load(&counters[k]);
   }
+}
 
-  method = TSHttpHdrMethodGet(bufp, hdr_loc, &method_length);
-  if (0 != strncmp(method, TS_HTTP_METHOD_GET, method_length)) {
-    debug("do not count %.*s method", method_length, method);
-    goto cleanup;
+// counters of evicted channels and their number
+static void
+read_evicted_stats(const counters_view *view, channel_stat *sum, uint64_t *channels)
+{
+  if (view) {
+    *sum = view->evicted;
+    *channels = view->evicted_channels;
+    return;
   }
 
-  if (TSHttpHdrUrlGet(bufp, hdr_loc, &url_loc) != TS_SUCCESS)
-    goto cleanup;
+#define X(field, name, prometheus_name, help, value) \
+  sum->field = relaxed_load(&evicted_stat.field);
+  CHANNEL_METRICS(X)
+#undef X
+  *channels = relaxed_load(&evicted_channels);
+}
 
-  path = TSUrlPathGet(bufp, url_loc, &path_len);
-  if (path_len == 0 || (unsigned)path_len != api_path.length() ||
-        strncmp(api_path.c_str(), path, path_len) != 0) {
-    goto not_api;
+static void
+read_global_stats(const counters_view *view, uint64_t *response_count_2xx_get,
+                  uint64_t *response_bytes_content)
+{
+  if (view) {
+    *response_count_2xx_get = view->response_count_2xx_get;
+    *response_bytes_content = view->response_bytes_content;
+    return;
   }
 
-  // register our intercept
-  debug_api("Intercepting request");
-  api_state = (intercept_state *) TSmalloc(sizeof(*api_state));
-  memset(api_state, 0, sizeof(*api_state));
-  get_api_params(bufp, url_loc,
-                 &api_state->show_global, &api_state->channel,
-                 &api_state->topn);
+  *response_count_2xx_get = relaxed_load(&globals->response_count_2xx_get);
+  *response_bytes_content = relaxed_load(&globals->response_bytes_content);
 
-  // check private ip
-  client_addr = (struct sockaddr *) TSHttpTxnClientAddrGet(txnp);
-  if (client_addr->sa_family == AF_INET) {
-    client_addr4 = (struct sockaddr_in *) client_addr;
-    if (!is_private_ip(&client_addr4->sin_addr)) {
-      client_ip = (char *) TSmalloc(INET_ADDRSTRLEN);
-      inet_ntop(AF_INET, &client_addr4->sin_addr, client_ip, INET_ADDRSTRLEN);
-      debug_api("%s is not a private IP, request denied", client_ip);
-      api_state->deny = 1;
-      TSfree(client_ip);
-    }
-  } else {
-    debug_api("not IPv4, request denied"); // TODO check AF_INET6's private IP?
-    api_state->deny = 1;
-  }
+  if (counters_type != COUNTERS_SHARDED)
+    return;
 
-  TSSkipRemappingSet(txnp, 1); //not strictly necessary
+  int n = get_num_shards();
+  for (int i = 0; i < n; i++) {
+    stat_shard *shard = __atomic_load_n(&shards[i], __ATOMIC_ACQUIRE);
+    if (!shard)
+      continue;
+    *response_count_2xx_get += relaxed_load(&shard->sides[0].global_response_count_2xx_get);
+    *response_bytes_content += relaxed_load(&shard->sides[0].global_response_bytes_content);
+  }
+}
 
-  api_contp = TSContCreate(api_handle_event, TSMutexCreate());
-  TSContDataSet(api_contp, api_state);
-  TSHttpTxnIntercept(api_contp, txnp);
+// add counters of src to dst and zero them, src has no writer until the
+// next epoch
+static void
+fold_block(channel_block *dst, channel_block *src)
+{
+  uint64_t *d = (uint64_t *) dst;
+  uint64_t *s = (uint64_t *) src;
 
-  goto cleanup;
+  for (size_t w = 0; w < sizeof(channel_block) / sizeof(uint64_t); w++) {
+    d[w] += relaxed_load(&s[w]);
+    __atomic_store_n(&s[w], 0, __ATOMIC_RELAXED);
+  }
+}
 
-not_api:
-  txn_contp = TSContCreate(handle_event, NULL); // reuse global handler
-  TSHttpTxnHookAdd(txnp, TS_HTTP_TXN_CLOSE_HOOK, txn_contp);
+// same for shared counters, which threads without shard may write
+static void
+fold_shared_block(channel_block *dst, channel_block *src)
+{
+  uint64_t *d = (uint64_t *) dst;
+  uint64_t *s = (uint64_t *) src;
 
-cleanup:
-  if (url_loc) TSHandleMLocRelease(bufp, hdr_loc, url_loc);
-  if (hdr_loc) TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+  for (size_t w = 0; w < sizeof(channel_block) / sizeof(uint64_t); w++)
+    d[w] += __atomic_exchange_n(&s[w], 0, __ATOMIC_RELAXED);
 }
 
+static void evict_sweep(counters_view *view);
+
+/*
+  Make the next view: the current one plus the counters of the epoch
+  which ends now, without the channels evicted by a sweep, if one is
+  due. The generation is bumped before the epoch, so a txn counted in
+  the new epoch marks its channel with the new generation at least, and
+  an output of the view, which returns it, never misses it in the next
+  delta. Return false if memory is short, nothing is folded.
+*/
 static bool
-get_pristine_host(TSHttpTxn txnp, TSMBuffer bufp, std::string &host)
+epoch_fold()
 {
-  TSMLoc purl_loc;
-  const char * pristine_host;
-  int pristine_host_len = 0;
-  int pristine_port;
-
-  if (TSHttpTxnPristineUrlGet(txnp, &bufp, &purl_loc) != TS_SUCCESS) {
-    debug("couldn't retrieve pristine url");
+  counters_view *cur = current_view; // only replaced here
+  counters_view *view;
+  channel_id count = registry.size();
+  uint32_t blocks = (count + CHANNEL_BLOCK_SIZE - 1) / CHANNEL_BLOCK_SIZE;
+
+  TSMutexLock(view_mutex);
+  view = spare_view;
+  spare_view = NULL;
+  TSMutexUnlock(view_mutex);
+  if (!view && !(view = (counters_view *) cache_line_alloc(sizeof(counters_view))))
     return false;
+  for (uint32_t b = 0; b < blocks; b++) {
+    if (!view->blocks[b] && !(view->blocks[b] = (channel_block *) cache_line_alloc(sizeof(channel_block)))) {
+      view_release(view); // refcount is 0, back to spare
+      return false;
+    }
   }
 
-  pristine_host = TSUrlHostGet(bufp, purl_loc, &pristine_host_len);
-  if (pristine_host_len == 0) {
-    debug("couldn't retrieve pristine host");
-    return false;
+  uint64_t generation = __sync_add_and_fetch(&globals->generation, 1);
+  uint32_t side = counters_epoch & 1;
+  __atomic_store_n(&counters_epoch, counters_epoch + 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); // epoch is bumped before seqs are read
+
+  wait_counting_txns(); // still in the old side
+  int n = get_num_shards();
+
+  // channels created since count are left in the old side, and folded
+  // when it's old again, unless their block is there
+  bool shared = __atomic_load_n(&epoch_shared_used, __ATOMIC_RELAXED);
+  view->count = std::min(registry.size(), blocks * CHANNEL_BLOCK_SIZE);
+  view->generation = generation;
+  view->response_count_2xx_get = cur->response_count_2xx_get;
+  view->response_bytes_content = cur->response_bytes_content;
+  for (int s = 0; s < n; s++) {
+    stat_shard *shard = __atomic_load_n(&shards[s], __ATOMIC_ACQUIRE);
+    if (!shard)
+      continue;
+    shard_counters *old = &shard->sides[side];
+    view->response_count_2xx_get += relaxed_load(&old->global_response_count_2xx_get);
+    view->response_bytes_content += relaxed_load(&old->global_response_bytes_content);
+    __atomic_store_n(&old->global_response_count_2xx_get, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&old->global_response_bytes_content, 0, __ATOMIC_RELAXED);
   }
-
-  pristine_port = TSUrlPortGet(bufp, purl_loc);
-  host = std::string(pristine_host, pristine_host_len);
-  if (pristine_port != 80) {
-    char buf[12];
-    if (!sprintf(buf, ":%d", pristine_port))
-      return false;
-    host.append(buf);
+  if (shared) {
+    view->response_count_2xx_get +=
+      __atomic_exchange_n(&globals->response_count_2xx_get, 0, __ATOMIC_RELAXED);
+    view->response_bytes_content +=
+      __atomic_exchange_n(&globals->response_bytes_content, 0, __ATOMIC_RELAXED);
   }
 
-  debug("pristine host: %.*s", pristine_host_len, pristine_host);
-  debug("pristine port: %d", pristine_port);
-  debug("host to lookup: %s", host.c_str());
+  for (uint32_t b = 0; b < blocks; b++) {
+    channel_block *block = view->blocks[b];
+    if (cur->blocks[b] && b * CHANNEL_BLOCK_SIZE < cur->count)
+      memcpy(block, cur->blocks[b], sizeof(channel_block));
+    else
+      memset(block, 0, sizeof(channel_block));
+    for (int s = 0; s < n; s++) {
+      stat_shard *shard = __atomic_load_n(&shards[s], __ATOMIC_ACQUIRE);
+      channel_block *old;
+      if (shard && (old = __atomic_load_n(&shard->sides[side].blocks[b], __ATOMIC_ACQUIRE)))
+        fold_block(block, old);
+    }
+    if (shared)
+      fold_shared_block(block, registry.block(b * CHANNEL_BLOCK_SIZE));
+  }
 
+  uint32_t now = TShrtime() / HRTIME_SECOND;
+  if (evict_idle > 0 && now >= evict_next_sweep) {
+    evict_sweep(view); // before the view is published
+    evict_next_sweep = now + EVICT_SWEEP_INTERVAL;
+  }
+  view->live = std::min(registry.live_size(), view->count);
+  read_evicted_stats(NULL, &view->evicted, &view->evicted_channels);
+
+  TSMutexLock(view_mutex);
+  view->refcount = 1;
+  current_view = view;
+  TSMutexUnlock(view_mutex);
+  view_release(cur);
   return true;
 }
 
-static bool
-get_channel_stat(const std::string &host,
-                 channel_stat *    &stat,
-                 int    status_code_type)
+static int
+epoch_handle_event(TSCont contp, TSEvent event, void *edata)
 {
-  smap_iterator stat_it;
+  if (!epoch_fold())
+    warning("no memory for next view, counters are folded later");
+  TSContSchedule(contp, epoch_interval, TS_THREAD_POOL_TASK);
+  return 0;
+}
 
-  stat_it = channel_stats.find(host);
+/* heavy hitters (--heavy-hitters=K): each thread counts requests and
+   bytes of every counted host, in the registry or not, in its own
+   Space-Saving sketches of K entries, so memory is fixed whatever the
+   number of hosts and no lock is taken. Sketches are merged on output. */
+static uint32_t heavy_hitters_size = 0;
+#define MAX_HEAVY_HITTERS 10000
 
-  if (stat_it != channel_stats.end()) {
-    stat = stat_it->second;
-  } else {
-    if (status_code_type != 2) {
-      // if request's host isn't in your remap.config, response code will be 404
-      // we should not count that channel in this situation
-      debug("not 2xx response, do not create stat for this channel now");
-      return false;
-    }
-    if (channel_stats.size() >= MAX_MAP_SIZE) {
-      warning("channel_stats map exceeds max size");
-      return false;
-    }
+struct hh_sketches {
+  space_saving requests;
+  space_saving bytes;
+};
 
-    stat = new channel_stat();
-    std::pair<smap_iterator, bool> insert_ret;
-    TSMutexLock(stats_map_mutex);
-    insert_ret = channel_stats.insert(std::make_pair(host, stat));
-    TSMutexUnlock(stats_map_mutex);
-    if (insert_ret.second == true) {
-      // insert successfully
-      debug("******** new channel(#%zu) ********", channel_stats.size());
-    } else {
-      warning("stat of this channel already existed");
-      delete stat;
-      stat = insert_ret.first->second;
-    }
+static hh_sketches *sketches[MAX_SHARDS];
+static int num_sketches = 0;
+static __thread hh_sketches *thread_sketches = NULL;
+static __thread bool thread_sketches_failed = false;
+
+// return NULL if current thread can't own sketches
+static hh_sketches *
+get_thread_sketches()
+{
+  if (likely(thread_sketches != NULL))
+    return thread_sketches;
+  if (thread_sketches_failed)
+    return NULL;
+
+  int idx = __sync_fetch_and_add(&num_sketches, 1);
+  if (idx >= MAX_SHARDS) {
+    warning("no heavy hitter sketches for this thread, its txns are not counted");
+    thread_sketches_failed = true;
+    return NULL;
   }
 
-  return true;
+  hh_sketches *hh = new hh_sketches;
+  hh->requests.init(heavy_hitters_size);
+  hh->bytes.init(heavy_hitters_size);
+  __atomic_store_n(&sketches[idx], hh, __ATOMIC_RELEASE);
+  thread_sketches = hh;
+  debug("new heavy hitter sketches #%d", idx);
+  return hh;
 }
 
-static uint64_t
-get_txn_user_speed(TSHttpTxn txnp, uint64_t body_bytes)
+static inline int
+get_num_sketches()
 {
-  uint64_t user_speed = 0;
-  TSHRTime start_time = 0;
-  TSHRTime end_time = 0;
-  TSHRTime interval_time = 0;
+  int n = __atomic_load_n(&num_sketches, __ATOMIC_ACQUIRE);
+  return n < MAX_SHARDS ? n : MAX_SHARDS;
+}
 
-#if (TS_VERSION_NUMBER < 3003001)
-  TSHttpTxnStartTimeGet(txnp, &start_time);
-  TSHttpTxnEndTimeGet(txnp, &end_time);
-#else
-  TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_UA_BEGIN, &start_time);
-  TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_UA_CLOSE, &end_time);
+/* channel index, maps "host[:port]" to channel id
+   - INDEX_HASH: lock-free lookup, the default
+   - INDEX_MAP: the original std::map, lookups are serialized by
+     stats_map_mutex, kept for comparison */
+enum index_type_t { INDEX_HASH, INDEX_MAP };
+static index_type_t index_type = INDEX_HASH;
+
+typedef std::map<std::string, channel_id> stats_map_t;
+typedef stats_map_t::iterator smap_iterator;
+
+static stats_map_t channel_stats;
+static channel_hash *channel_table; // replaced by index_rebuild() only
+static TSMutex stats_map_mutex; // serialize insertions (and all map access)
+
+// state file (--state-file), see channel_state.h
+static const char *state_path = NULL;
+static cstats_state_header *state = NULL;
+static int state_fd = -1; // kept open, it holds the lock
+
+/* filter index (--filter-index): channels matching the channel, prefix
+   or suffix parameter are looked up instead of scanning all names. It's
+   updated when a channel is added, under filter_index_mutex. */
+static bool enable_filter_index = false;
+static channel_filter_index *filter_index = NULL;
+static TSMutex filter_index_mutex;
+
+/* txn arg: channel of the txn, resolved at post remap
+   NULL: not resolved, TXN_CHANNEL_ABSENT: not in index yet, else
+   (tag << 32 | id) + 2, the registry tag tells if it was evicted since */
+static int txn_arg_idx;
+#define TXN_CHANNEL_ABSENT ((void *) 1)
+#define TXN_CHANNEL_ARG(id, tag) ((void *) ((((uintptr_t) (tag) << 32) | (id)) + 2))
+#define TXN_CHANNEL_ID(arg) ((channel_id) ((uintptr_t) (arg) - 2))
+#define TXN_CHANNEL_TAG(arg) ((uint32_t) (((uintptr_t) (arg) - 2) >> 32))
+
+typedef std::pair<channel_id, channel_stat> data_pair; // summed up stat
+typedef std::vector<data_pair> stats_vec_t;
+
+/* rankings, short names of metrics for the 'sort' and 'by' parameters,
+   the top cache keeps the best channels of each */
+static const struct {
+  const char *name;
+  uint64_t channel_stat::*field;
+} rankings[] = {
+  {"2xx", &channel_stat::response_count_2xx}, // default
+  {"bytes", &channel_stat::response_bytes_content},
+  {"5xx", &channel_stat::response_count_5xx},
+};
+
+#define NUM_RANKINGS ((int) (sizeof(rankings) / sizeof(rankings[0])))
+
+// index in channel_metrics of a counter of channel_stat
+static int
+metric_of(uint64_t channel_stat::*field)
+{
+  int m = 0;
+  while (channel_metrics[m].field != field)
+    m++;
+  return m;
+}
+
+// ranking of metric m, -1 if it's not one
+static int
+ranking_of(int m)
+{
+  for (int r = 0; r < NUM_RANKINGS; r++) {
+    if (rankings[r].field == channel_metrics[m].field)
+      return r;
+  }
+  return -1;
+}
+
+// better-than by a counter: greater, or less if ascending
+struct compare_stat
+{
+  uint64_t channel_stat::*field;
+  bool ascending;
+
+  compare_stat(uint64_t channel_stat::*field, bool ascending) : field(field), ascending(ascending) {}
+
+  inline bool operator()(const data_pair &lhs, const data_pair &rhs) const {
+    return ascending ? lhs.second.*field < rhs.second.*field : lhs.second.*field > rhs.second.*field;
+  }
+};
+
+// keep n best items in a heap, its front is the least (by cmp)
+static inline void
+top_push(stats_vec_t *top, size_t n, const compare_stat &cmp, const data_pair &item)
+{
+  if (top->size() < n) {
+    top->push_back(item);
+    std::push_heap(top->begin(), top->end(), cmp);
+  } else if (n > 0 && cmp(item, top->front())) {
+    std::pop_heap(top->begin(), top->end(), cmp);
+    top->back() = item;
+    std::push_heap(top->begin(), top->end(), cmp);
+  }
+}
+
+/* The api response is written in steps, one step on each WRITE_READY:
+   a step appends about API_CHUNK_SIZE bytes or looks at API_SCAN_STEP
+   channels at most, and none is taken while the client hasn't consumed
+   the previous chunk, so neither the time of an event nor the response
+   buffer grows with the number of channels. */
+#define API_CHUNK_SIZE (32 * 1024)
+#define API_SCAN_STEP 1024
+
+enum api_stage_t {
+  API_STAGE_START,
+  API_STAGE_TOP_SCAN, // topn: keep best channels in a heap
+  API_STAGE_NAMES, // bin: string table of channel names
+  API_STAGE_CHANNELS, // channel dicts, by cursor
+  API_STAGE_MERGE, // histograms of all channels, for global
+  API_STAGE_GLOBAL,
+  API_STAGE_DONE
+};
+
+enum output_format_t { FORMAT_JSON, FORMAT_PROMETHEUS, FORMAT_BIN };
+
+/* fields parameter: bit m is metric m of channel_metrics, the last two
+   are the rates and histograms groups */
+#define FIELD_METRIC(m) (1ULL << (m))
+#define FIELD_RATES (1ULL << 62)
+#define FIELD_HISTOGRAMS (1ULL << 63)
+#define FIELDS_ALL (~0ULL)
+typedef char fields_fit_in_mask[NUM_CHANNEL_METRICS <= 62 ? 1 : -1];
+
+struct render_job;
+
+// api Intercept Data
+typedef struct intercept_state_t
+{
+  TSVConn net_vc;
+  TSVIO read_vio;
+  TSVIO write_vio;
+
+  TSIOBuffer req_buffer;
+  TSIOBuffer resp_buffer;
+  TSIOBufferReader resp_reader;
+
+  int64_t output_bytes;
+  int body_written;
+  TSAction pending; // scheduled step, see stats_write_next()
+
+  int stage; // api_stage_t
+  channel_id count; // channels when output started
+  uint64_t generation; // of this output
+  channel_id cursor; // next channel (or index in top) to scan or output
+  uint32_t channels_out; // channel dicts written
+  int metric; // prometheus: metric being written
+  stats_vec_t * top; // topn: best channels, a heap until scan is done
+  std::vector<channel_id> * ids; // filter index: candidates, scanned instead of all
+  channel_histograms * merged; // sum of histograms of channels
+  counters_view * view; // epoch counters: what the output reads, else NULL
+  std::string * names; // bin with eviction: channel names, see bin_channel_names()
+  channel_id shard_end; // render shard: end of its channels by cursor, else 0
+  render_job * job; // parallel render in progress, else NULL
+  int snapshot; // snapshot render, see snapshot_render()
+  int64_t generation_begin; // json: body bytes of the generation stat
+  int64_t generation_end;
+
+  int show_global; // default 0
+  int format; // output_format_t
+  char * channel; // default ""
+  char * prefix; // default ""
+  char * suffix; // default "", a domain
+  int topn; // default -1, all channels
+  int deny; // default 0
+  char * if_none_match; // NULL if absent
+  uint64_t since; // default 0, all channels
+  int sort; // metric channels are sorted by, default -1 for id order
+  int ascending; // default 0
+  uint64_t fields; // metrics and groups output, default FIELDS_ALL
+} intercept_state;
+
+// sorted channels, the topn best, see start_top()
+static inline bool
+is_sorted_output(const intercept_state * api_state)
+{
+  return api_state->sort >= 0;
+}
+
+static inline compare_stat
+sort_compare(const intercept_state * api_state)
+{
+  return compare_stat(channel_metrics[api_state->sort].field, api_state->ascending);
+}
+
+struct private_seg_t {
+  struct in_addr net;
+  struct in_addr mask;
+};
+
+// don't put inet_addr("255.255.255.255"), see BUGS in 'man 3 inet_addr'
+static struct private_seg_t private_segs[] = {
+  {{inet_addr("10.0.0.0")}, {inet_addr("255.0.0.0")}},
+  {{inet_addr("127.0.0.0")}, {inet_addr("255.0.0.0")}},
+  {{inet_addr("172.16.0.0")}, {inet_addr("255.240.0.0")}},
+  {{inet_addr("192.168.0.0")}, {inet_addr("255.255.0.0")}}
+};
+static int num_private_segs = sizeof(private_segs) / sizeof(private_seg_t);
+
+// all parameters are in network byte order
+static int
+is_in_net (const struct in_addr * addr,
+           const struct in_addr * netaddr,
+           const struct in_addr * netmask)
+{
+   if ((addr->s_addr & netmask->s_addr) == (netaddr->s_addr & netmask->s_addr))
+      return 1;
+   return 0;
+}
+
+static int
+is_private_ip(const struct in_addr * addr)
+{
+  int i;
+  for (i = 0; i < num_private_segs; i++) {
+    if (is_in_net(addr, &private_segs[i].net, &private_segs[i].mask))
+      return 1;
+  }
+  return 0;
+}
+
+static int handle_event(TSCont contp, TSEvent event, void *edata);
+static int api_handle_event(TSCont contp, TSEvent event, void *edata);
+static bool stats_add_snapshot(intercept_state * api_state);
+static void render_start(TSCont contp, intercept_state * api_state);
+static void render_append(intercept_state * api_state);
+static void render_job_abort(render_job * job);
+
+/*
+  Api parameters, parsed from the query string in one pass: it's split on
+  '&' into 'name' or 'name=value' params, matched against api_params.
+  Unknown params and values are ignored, the first of a repeated param is
+  used. Values are not url-decoded.
+*/
+enum api_param_t {
+  PARAM_GLOBAL, // without value
+  PARAM_CHANNEL,
+  PARAM_PREFIX,
+  PARAM_SUFFIX,
+  PARAM_TOPN,
+  PARAM_LIMIT, // same as topn
+  PARAM_FORMAT,
+  PARAM_SINCE,
+  PARAM_BY,
+  PARAM_SORT,
+  PARAM_ORDER,
+  PARAM_FIELDS,
+  NUM_API_PARAMS
+};
+
+static const char *api_params[NUM_API_PARAMS] = {
+  "global", "channel", "prefix", "suffix", "topn", "limit", "format",
+  "since", "by", "sort", "order", "fields"
+};
+
+static int
+find_api_param(const char *name, size_t len)
+{
+  for (int i = 0; i < NUM_API_PARAMS; i++) {
+    if (strlen(api_params[i]) == len && memcmp(api_params[i], name, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static bool
+value_is(const char *value, size_t len, const char *s)
+{
+  return strlen(s) == len && memcmp(value, s, len) == 0;
+}
+
+// decimal value of up to max, false if it isn't one
+static bool
+parse_uint(const char *value, size_t len, uint64_t max, uint64_t *result)
+{
+  uint64_t v = 0;
+
+  if (len == 0)
+    return false;
+  for (size_t i = 0; i < len; i++) {
+    if (value[i] < '0' || value[i] > '9' || v > (max - (value[i] - '0')) / 10)
+      return false;
+    v = v * 10 + (value[i] - '0');
+  }
+  *result = v;
+  return true;
+}
+
+// metric named by its json name or a ranking name, -1 if none
+static int
+find_metric(const char *name, size_t len)
+{
+  for (int m = 0; m < NUM_CHANNEL_METRICS; m++) {
+    if (value_is(name, len, channel_metrics[m].name))
+      return m;
+  }
+  for (int r = 0; r < NUM_RANKINGS; r++) {
+    if (value_is(name, len, rankings[r].name))
+      return metric_of(rankings[r].field);
+  }
+  return -1;
+}
+
+// comma separated metric names, 'rates' and 'histograms'
+static uint64_t
+parse_fields(const char *value, size_t len)
+{
+  const char *end = value + len;
+  uint64_t fields = 0;
+
+  for (const char *p = value; p < end; ) {
+    const char *comma = (const char *) memchr(p, ',', end - p);
+    const char *next = comma ? comma : end;
+    int m = find_metric(p, next - p);
+    if (m >= 0)
+      fields |= FIELD_METRIC(m);
+    else if (value_is(p, next - p, "rates"))
+      fields |= FIELD_RATES;
+    else if (value_is(p, next - p, "histograms"))
+      fields |= FIELD_HISTOGRAMS;
+    p = next + 1;
+  }
+  return fields;
+}
+
+static void
+set_api_param(intercept_state * api_state, int param, const char *value, size_t len)
+{
+  uint64_t v;
+  int m;
+
+  switch (param) {
+  case PARAM_GLOBAL:
+    api_state->show_global = 1;
+    break;
+  case PARAM_CHANNEL:
+    api_state->channel = TSstrndup(value, len);
+    break;
+  case PARAM_PREFIX:
+    api_state->prefix = TSstrndup(value, len);
+    break;
+  case PARAM_SUFFIX:
+    api_state->suffix = TSstrndup(value, len);
+    break;
+  case PARAM_TOPN:
+  case PARAM_LIMIT:
+    if (parse_uint(value, len, INT32_MAX, &v))
+      api_state->topn = v;
+    break;
+  case PARAM_FORMAT:
+    if (value_is(value, len, "prometheus"))
+      api_state->format = FORMAT_PROMETHEUS;
+    else if (value_is(value, len, "bin"))
+      api_state->format = FORMAT_BIN;
+    break;
+  case PARAM_SINCE:
+    if (parse_uint(value, len, UINT64_MAX, &v))
+      api_state->since = v;
+    break;
+  case PARAM_BY:
+  case PARAM_SORT:
+    if ((m = find_metric(value, len)) >= 0)
+      api_state->sort = m;
+    break;
+  case PARAM_ORDER:
+    if (value_is(value, len, "asc"))
+      api_state->ascending = 1;
+    break;
+  case PARAM_FIELDS:
+    api_state->fields = parse_fields(value, len);
+    break;
+  }
+}
+
+// defaults of api parameters, all channels in id order
+static void
+init_api_params(intercept_state * api_state)
+{
+  api_state->show_global = 0;
+  api_state->channel = NULL;
+  api_state->prefix = NULL;
+  api_state->suffix = NULL;
+  api_state->topn = -1;
+  api_state->format = FORMAT_JSON;
+  api_state->since = 0;
+  api_state->sort = -1;
+  api_state->ascending = 0;
+  api_state->fields = FIELDS_ALL;
+}
+
+static void
+get_api_params(TSMBuffer bufp, TSMLoc url_loc, intercept_state * api_state)
+{
+  const char *query; // not null-terminated, get from TS api
+  const char *end;
+  int query_len = 0;
+  uint32_t seen = 0;
+
+  init_api_params(api_state);
+  query = TSUrlHttpQueryGet(bufp, url_loc, &query_len);
+  end = query + query_len;
+  if (query_len > 0)
+    debug_api("querystring: %.*s", query_len, query);
+
+  for (const char *p = query; p < end; ) {
+    const char *amp = (const char *) memchr(p, '&', end - p);
+    const char *next = amp ? amp : end;
+    const char *eq = (const char *) memchr(p, '=', next - p);
+    int param = find_api_param(p, (eq ? eq : next) - p);
+
+    if (param >= 0 && !(seen & (1U << param)) && (eq != NULL) == (param != PARAM_GLOBAL)) {
+      seen |= 1U << param;
+      if (eq)
+        set_api_param(api_state, param, eq + 1, next - eq - 1);
+      else
+        set_api_param(api_state, param, NULL, 0);
+      debug_api("found '%s' param: %.*s", api_params[param], eq ? (int) (next - eq - 1) : 0, eq ? eq + 1 : "");
+    }
+    p = next + 1;
+  }
+
+  // never NULL
+  if (!api_state->channel)
+    api_state->channel = TSstrdup("");
+  if (!api_state->prefix)
+    api_state->prefix = TSstrdup("");
+  if (!api_state->suffix)
+    api_state->suffix = TSstrdup("");
+  // topn alone ranks by the default
+  if (api_state->topn >= 0 && api_state->sort < 0)
+    api_state->sort = metric_of(rankings[0].field);
+}
+
+static void
+handle_read_req(TSCont contp, TSHttpTxn txnp)
+{
+  TSMBuffer bufp;
+  TSMLoc hdr_loc = NULL;
+  TSMLoc url_loc = NULL;
+  const char *method;
+  int method_length = 0;
+  TSCont txn_contp;
+
+  const char * path;
+  int path_len;
+  struct sockaddr * client_addr;
+  struct sockaddr_in * client_addr4;
+  TSCont api_contp;
+  char * client_ip;
+  TSMLoc field_loc;
+  const char * value;
+  int value_len;
+  intercept_state *api_state;
+
+  if (TSHttpTxnClientReqGet(txnp, &bufp, &hdr_loc) != TS_SUCCESS) {
+    error("couldn't retrieve client's request");
+    goto cleanup;
+  }
+
+  method = TSHttpHdrMethodGet(bufp, hdr_loc, &method_length);
+  if (0 != strncmp(method, TS_HTTP_METHOD_GET, method_length)) {
+#ifdef CSTATS_ALL_METHODS
+    goto not_api; // only counted by status and method metrics
+#else
+    debug("do not count %.*s method", method_length, method);
+    goto cleanup;
+#endif
+  }
+
+  if (TSHttpHdrUrlGet(bufp, hdr_loc, &url_loc) != TS_SUCCESS)
+    goto cleanup;
+
+  path = TSUrlPathGet(bufp, url_loc, &path_len);
+  if (path_len == 0 || (unsigned)path_len != api_path.length() ||
+        strncmp(api_path.c_str(), path, path_len) != 0) {
+    goto not_api;
+  }
+
+  // register our intercept
+  debug_api("Intercepting request");
+  api_state = (intercept_state *) TSmalloc(sizeof(*api_state));
+  memset(api_state, 0, sizeof(*api_state));
+  get_api_params(bufp, url_loc, api_state);
+
+  field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_IF_NONE_MATCH,
+                                 TS_MIME_LEN_IF_NONE_MATCH);
+  if (field_loc) {
+    value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, -1, &value_len);
+    api_state->if_none_match = TSstrndup(value, value_len);
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+  }
+
+  // check private ip
+  client_addr = (struct sockaddr *) TSHttpTxnClientAddrGet(txnp);
+  if (client_addr->sa_family == AF_INET) {
+    client_addr4 = (struct sockaddr_in *) client_addr;
+    if (!is_private_ip(&client_addr4->sin_addr)) {
+      client_ip = (char *) TSmalloc(INET_ADDRSTRLEN);
+      inet_ntop(AF_INET, &client_addr4->sin_addr, client_ip, INET_ADDRSTRLEN);
+      debug_api("%s is not a private IP, request denied", client_ip);
+      api_state->deny = 1;
+      TSfree(client_ip);
+    }
+  } else {
+    debug_api("not IPv4, request denied"); // TODO check AF_INET6's private IP?
+    api_state->deny = 1;
+  }
+
+  TSSkipRemappingSet(txnp, 1); //not strictly necessary
+
+  api_contp = TSContCreate(api_handle_event, TSMutexCreate());
+  TSContDataSet(api_contp, api_state);
+  TSHttpTxnIntercept(api_contp, txnp);
+
+  goto cleanup;
+
+not_api:
+#ifdef PER_TXN_CONT
+  // one continuation per txn as version 0.2 did, only built by benchmark
+  txn_contp = TSContCreate(handle_event, NULL); // reuse global handler
+#else
+  // share the global continuation, data of txn is kept in txn arg
+  txn_contp = contp;
+#endif
+  TSHttpTxnHookAdd(txnp, TS_HTTP_POST_REMAP_HOOK, txn_contp);
+  TSHttpTxnHookAdd(txnp, TS_HTTP_TXN_CLOSE_HOOK, txn_contp);
+
+cleanup:
+  if (url_loc) TSHandleMLocRelease(bufp, hdr_loc, url_loc);
+  if (hdr_loc) TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+}
+
+/*
+  Write "host[:port]" of pristine url to buffer, port is omitted if it's 80.
+  Return the length, or 0 if it's not available or too long.
+*/
+static int
+get_pristine_host(TSHttpTxn txnp, char *host, int size)
+{
+  TSMBuffer bufp;
+  TSMLoc purl_loc;
+  const char * pristine_host;
+  int pristine_host_len = 0;
+  int pristine_port;
+  int len = 0;
+
+  if (TSHttpTxnPristineUrlGet(txnp, &bufp, &purl_loc) != TS_SUCCESS) {
+    debug("couldn't retrieve pristine url");
+    return 0;
+  }
+
+  pristine_host = TSUrlHostGet(bufp, purl_loc, &pristine_host_len);
+  if (pristine_host_len == 0) {
+    debug("couldn't retrieve pristine host");
+    goto cleanup;
+  }
+
+  pristine_port = TSUrlPortGet(bufp, purl_loc);
+  if (pristine_port != 80)
+    len = snprintf(host, size, "%.*s:%d", pristine_host_len, pristine_host, pristine_port);
+  else
+    len = snprintf(host, size, "%.*s", pristine_host_len, pristine_host);
+  if (len >= size) {
+    debug("pristine host is too long: %.*s", pristine_host_len, pristine_host);
+    len = 0;
+    goto cleanup;
+  }
+
+  debug("pristine host: %.*s", pristine_host_len, pristine_host);
+  debug("pristine port: %d", pristine_port);
+  debug("host to lookup: %s", host);
+
+cleanup:
+  TSHandleMLocRelease(bufp, TS_NULL_MLOC, purl_loc);
+  return len;
+}
+
+/* a lookup without lock, with eviction, is a section which the sweep
+   waits for, as a txn being counted, before it frees a replaced hash
+   table, see index_rebuild() */
+static stat_shard *
+lookup_enter()
+{
+  stat_shard *shard = get_thread_shard();
+  if (shard) {
+    shard_enter(shard);
+  } else {
+    __atomic_add_fetch(&unsharded_counting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+  return shard;
+}
+
+static void
+lookup_leave(stat_shard *shard)
+{
+  if (shard)
+    shard_leave(shard);
+  else
+    __atomic_sub_fetch(&unsharded_counting, 1, __ATOMIC_RELEASE);
+}
+
+// id of a channel and its registry tag
+static channel_id
+channel_index_find(const char *host, size_t len, uint32_t *tag)
+{
+  if (index_type == INDEX_HASH && evict_idle > 0) {
+    stat_shard *shard = lookup_enter();
+    channel_id id = __atomic_load_n(&channel_table, __ATOMIC_ACQUIRE)->find(host, len, tag);
+    lookup_leave(shard);
+    return id;
+  }
+  if (index_type == INDEX_HASH)
+    return channel_table->find(host, len, tag);
+
+  channel_id id = CHANNEL_ID_NONE;
+  std::string key(host, len);
+  TSMutexLock(stats_map_mutex);
+  smap_iterator stat_it = channel_stats.find(key);
+  if (stat_it != channel_stats.end()) {
+    id = stat_it->second;
+    *tag = registry.tag(id);
+  }
+  TSMutexUnlock(stats_map_mutex);
+  return id;
+}
+
+// caller must hold stats_map_mutex
+static channel_id
+channel_index_find_locked(const char *host, size_t len, uint32_t *tag)
+{
+  if (index_type == INDEX_HASH)
+    return channel_table->find(host, len, tag);
+
+  smap_iterator stat_it = channel_stats.find(std::string(host, len));
+  if (stat_it == channel_stats.end())
+    return CHANNEL_ID_NONE;
+  *tag = registry.tag(stat_it->second);
+  return stat_it->second;
+}
+
+// caller must hold stats_map_mutex
+static void
+channel_index_erase(const char *host, size_t len, channel_id id)
+{
+  if (index_type == INDEX_HASH)
+    channel_table->erase(host, len, id);
+  else
+    channel_stats.erase(std::string(host, len));
+}
+
+// channel of host, created by a 2xx GET txn only, as version 0.2 did
+static bool
+get_channel_id(const char *      host,
+               size_t            len,
+               channel_id        &id,
+               uint32_t          &tag,
+               int    status_code_type,
+               bool   is_get)
+{
+  id = channel_index_find(host, len, &tag);
+  if (id != CHANNEL_ID_NONE)
+    return true;
+
+  if (status_code_type != 2) {
+    // if request's host isn't in your remap.config, response code will be 404
+    // we should not count that channel in this situation
+    debug("not 2xx response, do not create stat for this channel now");
+    return false;
+  }
+  if (!is_get) {
+    // other methods only count in channels of GET txns
+    debug("not GET request, do not create stat for this channel now");
+    return false;
+  }
+  if (registry.live_size() >= registry.max_size()) {
+    warning("channel_stats map exceeds max size");
+    return false;
+  }
+
+  bool existed = false;
+  TSMutexLock(stats_map_mutex);
+  id = channel_index_find_locked(host, len, &tag);
+  if (id != CHANNEL_ID_NONE) {
+    existed = true;
+  } else {
+    id = registry.add(host, len);
+    if (id != CHANNEL_ID_NONE) {
+      tag = registry.tag(id);
+      mark_channel_generation(id); // not idle before its first txn
+      if (state)
+        __atomic_store_n(&state->count, id + 1, __ATOMIC_RELEASE);
+      if (index_type == INDEX_HASH) {
+        channel_table->insert(host, len, id);
+        if (state)
+          __atomic_store_n(&state->indexed, id + 1, __ATOMIC_RELEASE);
+      } else {
+        channel_stats.insert(std::make_pair(std::string(host, len), id));
+      }
+      if (filter_index) {
+        TSMutexLock(filter_index_mutex);
+        filter_index->add(id, host, len);
+        TSMutexUnlock(filter_index_mutex);
+      }
+    }
+  }
+  TSMutexUnlock(stats_map_mutex);
+
+  if (existed) {
+    warning("stat of this channel already existed");
+  } else if (id == CHANNEL_ID_NONE) {
+    warning("channel_stats map exceeds max size");
+    return false;
+  } else {
+    // insert successfully
+    debug("******** new channel(#%u) ********", id + 1);
+  }
+
+  return true;
+}
+
+// move counters of slot i of block to sum
+static void
+take_block_stat(channel_block *block, uint32_t i, channel_stat *sum)
+{
+#define X(field, name, prometheus_name, help, value) \
+  sum->field += __atomic_exchange_n(&block->field[i], 0, __ATOMIC_RELAXED);
+  CHANNEL_METRICS(X)
+#undef X
+}
+
+// move all counters of a retired channel to sum, also from view if not NULL
+static void
+take_channel_stat(counters_view *view, channel_id id, channel_stat *sum)
+{
+  uint32_t b = id / CHANNEL_BLOCK_SIZE;
+  uint32_t i = channel_registry::slot(id);
+  channel_block *block;
+
+  take_block_stat(registry.block(id), i, sum);
+  if (view && id < view->count && view->blocks[b])
+    take_block_stat(view->blocks[b], i, sum);
+  if (counters_type == COUNTERS_ATOMIC)
+    return;
+
+  int n = get_num_shards();
+  for (int s = 0; s < n; s++) {
+    stat_shard *shard = __atomic_load_n(&shards[s], __ATOMIC_ACQUIRE);
+    for (int side = 0; shard && side < 2; side++) {
+      block = __atomic_load_n(&shard->sides[side].blocks[b], __ATOMIC_ACQUIRE);
+      if (block)
+        take_block_stat(block, i, sum);
+    }
+  }
+}
+
+#define INDEX_REBUILD_TOMBSTONES 4 // rebuild hash table when 1/4 of slots are tombstones
+
+static std::deque<std::pair<uint32_t, uint64_t> > evict_history; // time and generation of sweeps
+static std::vector<channel_id> evict_released; // retired by the last sweep
+
+/*
+  Evict channels idle for evict_idle seconds. Each sweep bumps the
+  generation and remembers it, a channel is idle if nothing marked it
+  since a sweep at least evict_idle old, see mark_channel_generation().
+  - under stats_map_mutex, its id is retired (its tag is bumped) and its
+    name is taken out of the index and the filter index, so no new txn
+    gets it
+  - a txn which got it before sees the tag when it's counted and counts
+    in evicted stats. Txns being counted are waited for, by the seq of
+    their shard, then the counters of the channel are moved to evicted
+    stats and its rates and histograms are reset.
+  - the id is released at the next sweep, so an output in progress
+    rarely sees it given to another channel. Outputs skip retired ids.
+  With epoch counters the fold calls it, view is the next view.
+*/
+static void index_rebuild();
+
+static void
+evict_sweep(counters_view *view)
+{
+  uint32_t now = TShrtime() / HRTIME_SECOND;
+  uint64_t idle_generation = 0;
+  std::vector<channel_id> idle;
+  const char *name;
+  size_t len;
+
+  evict_history.push_back(std::make_pair(now, __sync_add_and_fetch(&globals->generation, 1)));
+  while (evict_history.size() > 1 && evict_history[1].first + evict_idle <= now)
+    evict_history.pop_front();
+  if (evict_history.front().first + evict_idle <= now)
+    idle_generation = evict_history.front().second;
+
+  TSMutexLock(stats_map_mutex);
+  for (size_t k = 0; k < evict_released.size(); k++)
+    registry.release(evict_released[k]);
+  evict_released.clear();
+  channel_id count = registry.size();
+  for (channel_id id = 0; idle_generation > 0 && id < count; id++) {
+    if (!channel_registry::is_live(registry.tag(id)) ||
+        __atomic_load_n(&channel_generations[id], __ATOMIC_RELAXED) >= idle_generation)
+      continue;
+    name = registry.name(id, &len);
+    registry.retire(id);
+    channel_index_erase(name, len, id);
+    if (filter_index) {
+      TSMutexLock(filter_index_mutex);
+      filter_index->remove(id, name, len);
+      TSMutexUnlock(filter_index_mutex);
+    }
+    idle.push_back(id);
+  }
+  TSMutexUnlock(stats_map_mutex);
+  if (index_type == INDEX_HASH)
+    index_rebuild();
+  if (idle.empty())
+    return;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); // tags are bumped before seqs are read
+  wait_counting_txns();
+  for (size_t k = 0; k < idle.size(); k++) {
+    channel_id id = idle[k];
+    channel_stat sum;
+    take_channel_stat(view, id, &sum);
+    add_evicted_stat(sum);
+    if (histograms)
+      memset(&histograms[id], 0, sizeof(histograms[id]));
+    if (rates)
+      memset(&rates[id], 0, sizeof(rates[id]));
+  }
+  __atomic_store_n(&evicted_channels, evicted_channels + idle.size(), __ATOMIC_RELAXED);
+  evict_released.swap(idle);
+  info("evicted %u channels idle for %d min", (uint32_t) evict_released.size(), evict_idle / 60);
+}
+
+/*
+  Erased names leave tombstones in the hash table, which lookups of an
+  absent name probe over. Past 1/INDEX_REBUILD_TOMBSTONES of slots, live
+  channels are indexed in a new table which replaces it, and the old one
+  is freed once lookups which may read it are done, as the sweep waits
+  for txns being counted.
+*/
+static void
+index_rebuild()
+{
+  channel_hash *old, *table;
+  const char *name;
+  size_t len;
+
+  TSMutexLock(stats_map_mutex);
+  old = channel_table;
+  if (old->tombstones() * INDEX_REBUILD_TOMBSTONES < old->slots()) {
+    TSMutexUnlock(stats_map_mutex);
+    return;
+  }
+  table = new channel_hash(&registry, MAX_MAP_SIZE);
+  channel_id count = registry.size();
+  for (channel_id id = 0; id < count; id++) {
+    if (!channel_registry::is_live(registry.tag(id)))
+      continue;
+    name = registry.name(id, &len);
+    table->insert(name, len, id);
+  }
+  __atomic_store_n(&channel_table, table, __ATOMIC_RELEASE);
+  TSMutexUnlock(stats_map_mutex);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST); // table is replaced before seqs are read
+  wait_counting_txns();
+  info("rebuilt channel index, %u tombstones dropped", (uint32_t) old->tombstones());
+  delete old;
+}
+
+static int
+evict_handle_event(TSCont contp, TSEvent event, void *edata)
+{
+  evict_sweep(NULL);
+  TSContSchedule(contp, EVICT_SWEEP_INTERVAL * 1000, TS_THREAD_POOL_TASK);
+  return 0;
+}
+
+/*
+  Return client speed in bytes per second, 0 if time is invalid.
+  Duration of the txn is set to interval_time, -1 if time is invalid.
+*/
+static uint64_t
+get_txn_user_speed(TSHttpTxn txnp, uint64_t body_bytes, TSHRTime *interval_ret)
+{
+  uint64_t user_speed = 0;
+  TSHRTime start_time = 0;
+  TSHRTime end_time = 0;
+  TSHRTime interval_time = 0;
+
+#if (TS_VERSION_NUMBER < 3003001)
+  TSHttpTxnStartTimeGet(txnp, &start_time);
+  TSHttpTxnEndTimeGet(txnp, &end_time);
+#else
+  TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_UA_BEGIN, &start_time);
+  TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_UA_CLOSE, &end_time);
+#endif
+
+  if (start_time != 0 && end_time != 0 && end_time >= start_time) {
+    interval_time = end_time - start_time;
+  } else {
+    warning("invalid time, start: %" PRId64", end: %" PRId64"", start_time, end_time);
+    *interval_ret = -1;
+    return 0;
+  }
+  *interval_ret = interval_time;
+
+  if (interval_time == 0 || body_bytes == 0)
+    user_speed = MAX_SPEED;
+  else
+    user_speed = (uint64_t)((float)body_bytes / interval_time * HRTIME_SECOND);
+
+  debug("start time: %" PRId64 "", start_time);
+  debug("end time: %" PRId64 "", end_time);
+  debug("interval time: %" PRId64 "", interval_time);
+  debug("interval seconds: %.5f", interval_time / (float)HRTIME_SECOND);
+  debug("speed bytes per second: %" PRIu64 "", user_speed);
+
+  return user_speed;
+}
+
+/*
+  Resolve the channel once the pristine url is ready, and attach it to the
+  transaction, so that txn close needn't build the host and look it up.
+  An unknown channel is marked as absent, it's created at txn close if the
+  response turns out to be 2xx.
+*/
+static void
+handle_post_remap(TSHttpTxn txnp)
+{
+  char host[MAX_HOST_LEN];
+  int host_len;
+  channel_id id;
+  uint32_t tag;
+
+  host_len = get_pristine_host(txnp, host, sizeof(host));
+  if (host_len == 0)
+    return;
+
+  id = channel_index_find(host, host_len, &tag);
+  if (id != CHANNEL_ID_NONE && evict_idle > 0)
+    mark_channel_generation(id); // not idle while the txn runs
+  TSHttpTxnArgSet(txnp, txn_arg_idx,
+                  id != CHANNEL_ID_NONE ? TXN_CHANNEL_ARG(id, tag) : TXN_CHANNEL_ABSENT);
+}
+
+// count txn in heavy hitter sketches of this thread
+static void
+count_heavy_hitter(TSHttpTxn txnp, void *arg, uint64_t body_bytes)
+{
+  hh_sketches *hh = get_thread_sketches();
+  char host[MAX_HOST_LEN];
+  size_t len = 0;
+
+  if (!hh)
+    return;
+  if (arg != NULL && arg != TXN_CHANNEL_ABSENT)
+    len = registry.copy_name(TXN_CHANNEL_ID(arg), TXN_CHANNEL_TAG(arg), host, sizeof(host));
+  if (len == 0) // no channel, or evicted
+    len = get_pristine_host(txnp, host, sizeof(host));
+  if (len == 0)
+    return;
+
+  hh->requests.add(host, len, 1);
+  if (body_bytes)
+    hh->bytes.add(host, len, body_bytes);
+}
+
+#ifdef CSTATS_ALL_METHODS
+// indexed by txn_method
+static const char *method_names[NUM_METHODS] = {
+  NULL, TS_HTTP_METHOD_GET, TS_HTTP_METHOD_HEAD, TS_HTTP_METHOD_POST,
+  TS_HTTP_METHOD_PUT, TS_HTTP_METHOD_DELETE
+};
+
+static int
+get_txn_method(TSHttpTxn txnp)
+{
+  TSMBuffer bufp;
+  TSMLoc hdr_loc;
+  const char *method;
+  int method_length;
+  int m = METHOD_OTHER;
+
+  if (TSHttpTxnClientReqGet(txnp, &bufp, &hdr_loc) != TS_SUCCESS)
+    return METHOD_OTHER;
+  method = TSHttpHdrMethodGet(bufp, hdr_loc, &method_length);
+  for (int k = METHOD_OTHER + 1; method && k < NUM_METHODS; k++) {
+    if ((size_t) method_length == strlen(method_names[k]) &&
+        memcmp(method, method_names[k], method_length) == 0) {
+      m = k;
+      break;
+    }
+  }
+  TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+  return m;
+}
+#endif
+
+#ifndef CSTATS_NO_ORIGIN_METRICS
+// time from begin to end milestone in us, 0 if one is not set
+static inline uint64_t
+milestone_interval_us(TSHRTime begin, TSHRTime end)
+{
+  if (begin <= 0 || end < begin)
+    return 0;
+  return (end - begin) / HRTIME_USECOND;
+}
+
+// cache result and origin timing of a GET txn, from its milestones
+static void
+get_txn_origin(TSHttpTxn txnp, txn_values *t)
+{
+  TSHRTime connect = 0, connect_end = 0, begin_write = 0, first_read = 0, close = 0;
+  int64_t bytes;
+
+  if (TSHttpTxnCacheLookupStatusGet(txnp, &t->cache_lookup) != TS_SUCCESS)
+    t->cache_lookup = -1;
+  bytes = TSHttpTxnServerRespBodyBytesGet(txnp);
+  t->origin_bytes = bytes > 0 ? bytes : 0;
+
+  TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_SERVER_CONNECT, &connect);
+  if (connect <= 0)
+    return; // served without origin
+  TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_SERVER_CONNECT_END, &connect_end);
+  TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_SERVER_BEGIN_WRITE, &begin_write);
+  TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_SERVER_FIRST_READ, &first_read);
+  TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_SERVER_CLOSE, &close);
+  if (close <= 0) // origin connection still open, it ended with the txn
+    TSHttpTxnMilestoneGet(txnp, TS_MILESTONE_UA_CLOSE, &close);
+
+  t->origin = 1;
+  t->origin_connect_us = milestone_interval_us(connect, connect_end);
+  t->origin_ttfb_us = milestone_interval_us(begin_write, first_read);
+  t->origin_total_us = milestone_interval_us(connect, close);
+}
+#endif
+
+/*
+  Add a txn to globals, and to the channel unless id is CHANNEL_ID_NONE,
+  in the shard of the thread if any, with its rates and histograms. With
+  epoch counters, all of it is in one epoch. With eviction, a channel
+  whose tag changed was evicted while the txn ran, the txn is added to
+  evicted stats instead, and the sweep waits for it while it's counted.
+*/
+static void
+count_txn(channel_id id, uint32_t tag, const txn_values &t, TSHRTime interval_time)
+{
+  bool is_get = t.method == METHOD_GET;
+  bool guarded = counters_type == COUNTERS_EPOCH || evict_idle > 0; // see stat_shard
+  stat_shard *shard = NULL;
+  shard_counters *side = NULL;
+  channel_block *block;
+  uint32_t i = channel_registry::slot(id);
+
+  if (counters_type != COUNTERS_ATOMIC || evict_idle > 0)
+    shard = get_thread_shard();
+  if (shard && guarded) {
+    shard_enter(shard);
+  } else if (evict_idle > 0) {
+    __atomic_add_fetch(&unsharded_counting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+  if (shard && counters_type != COUNTERS_ATOMIC)
+    side = &shard->sides[counters_type == COUNTERS_EPOCH ?
+                         __atomic_load_n(&counters_epoch, __ATOMIC_RELAXED) & 1 : 0];
+
+  if (!is_get) {
+    // only counted by metrics of all methods
+  } else if (side) {
+    relaxed_add(&side->global_response_bytes_content, t.body_bytes);
+    if (t.status_class == 2)
+      relaxed_add(&side->global_response_count_2xx_get, 1);
+  } else {
+    __sync_fetch_and_add(&globals->response_bytes_content, t.body_bytes);
+    if (t.status_class == 2)
+      __sync_fetch_and_add(&globals->response_count_2xx_get, 1);
+  }
+
+  if (evict_idle > 0 && id != CHANNEL_ID_NONE && registry.tag(id) != tag) {
+    add_evicted_txn(t);
+    id = CHANNEL_ID_NONE;
+  }
+
+  if (id != CHANNEL_ID_NONE) {
+    if (rates && is_get)
+      rates[id].add(TShrtime() / HRTIME_SECOND, t.body_bytes, t.status_class == 5);
+
+    if (histograms && is_get) {
+      if (interval_time >= 0)
+        histograms[id].duration.record(interval_time / HRTIME_MSECOND);
+      if (t.user_speed > 0 && t.body_bytes > 0)
+        histograms[id].speed.record(t.user_speed / 1024);
+    }
+
+    if (side && (block = get_shard_block(side, id)) != NULL) {
+      add_block_txn<false>(block, i, t);
+    } else {
+      add_block_txn<true>(registry.block(id), i, t);
+      side = NULL;
+    }
+    mark_channel_generation(id); // after counters, see there
+  }
+
+  if (counters_type == COUNTERS_EPOCH && !side &&
+      unlikely(!__atomic_load_n(&epoch_shared_used, __ATOMIC_RELAXED)))
+    __atomic_store_n(&epoch_shared_used, true, __ATOMIC_RELAXED);
+  if (shard && guarded)
+    shard_leave(shard);
+  else if (evict_idle > 0)
+    __atomic_sub_fetch(&unsharded_counting, 1, __ATOMIC_RELEASE);
+}
+
+static void
+handle_txn_close(TSCont contp, TSHttpTxn txnp)
+{
+  TSMBuffer bufp;
+  TSMLoc hdr_loc;
+  TSHttpStatus status_code;
+  int status_code_type;
+  uint64_t user_speed;
+  uint64_t body_bytes;
+  TSHRTime interval_time = -1;
+  void *arg;
+  channel_id id = CHANNEL_ID_NONE;
+  uint32_t tag = 0;
+  txn_values t;
+  bool is_get;
+
+  if (TSHttpTxnClientRespGet(txnp, &bufp, &hdr_loc) != TS_SUCCESS) {
+    debug("couldn't retrieve final response");
+    return;
+  }
+
+  status_code = TSHttpHdrStatusGet(bufp, hdr_loc);
+  status_code_type = status_code / 100;
+  body_bytes = TSHttpTxnClientRespBodyBytesGet(txnp);
+#ifdef CSTATS_ALL_METHODS
+  t.method = get_txn_method(txnp);
+#else
+  t.method = METHOD_GET; // only GET txns are hooked
+#endif
+  is_get = t.method == METHOD_GET;
+  t.status_class = status_code_type;
+  t.body_bytes = body_bytes;
+
+  debug("body bytes: %" PRIu64 "", body_bytes);
+
+  // normally the channel has been resolved at post remap
+  arg = TSHttpTxnArgGet(txnp, txn_arg_idx);
+
+  if (heavy_hitters_size && is_get)
+    count_heavy_hitter(txnp, arg, body_bytes);
+
+  if (likely(arg != NULL && arg != TXN_CHANNEL_ABSENT)) {
+    id = TXN_CHANNEL_ID(arg);
+    tag = TXN_CHANNEL_TAG(arg);
+  } else {
+    if (arg == TXN_CHANNEL_ABSENT && (status_code_type != 2 || !is_get)) {
+      debug("not 2xx GET response, do not create stat for this channel now");
+      goto count;
+    }
+
+    char host[MAX_HOST_LEN];
+    int host_len = get_pristine_host(txnp, host, sizeof(host));
+    // get or create the channel
+    if (host_len == 0 || !get_channel_id(host, host_len, id, tag, status_code_type, is_get)) {
+      id = CHANNEL_ID_NONE;
+      goto count;
+    }
+  }
+
+  user_speed = get_txn_user_speed(txnp, body_bytes, &interval_time);
+
+  t.user_speed = user_speed;
+  t.cache_lookup = -1;
+  t.origin_bytes = 0;
+  t.origin = 0;
+  t.origin_connect_us = t.origin_ttfb_us = t.origin_total_us = 0;
+#ifndef CSTATS_NO_ORIGIN_METRICS
+  if (is_get)
+    get_txn_origin(txnp, &t);
+#endif
+
+count:
+  count_txn(id, tag, t, interval_time);
+
+  if (unlikely(TSIsDebugTagSet(TAG)) && id != CHANNEL_ID_NONE && counters_type != COUNTERS_EPOCH) {
+    channel_stat sum;
+    read_channel_stat(NULL, id, &sum);
+    sum.debug_channel();
+  }
+
+  TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+}
+
+static int
+handle_event(TSCont contp, TSEvent event, void *edata) {
+  TSHttpTxn txnp = (TSHttpTxn) edata;
+
+  switch (event) {
+    case TS_EVENT_HTTP_READ_REQUEST_HDR: // global hook
+      debug("---------- new request ----------");
+      handle_read_req(contp, txnp);
+      break;
+    case TS_EVENT_HTTP_POST_REMAP: // txn hook
+      handle_post_remap(txnp);
+      break;
+    case TS_EVENT_HTTP_TXN_CLOSE: // txn hook
+      handle_txn_close(contp, txnp);
+#ifdef PER_TXN_CONT
+      TSContDestroy(contp);
 #endif
+      break;
+    default:
+      error("unknown event for this plugin");
+  }
+
+  TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
+
+  return 0;
+}
+
+// below is api part
+
+// free what json_out_stats_step() allocated
+static void
+json_out_free(intercept_state * api_state)
+{
+  delete api_state->top;
+  api_state->top = NULL;
+  TSfree(api_state->merged);
+  api_state->merged = NULL;
+  delete api_state->ids;
+  api_state->ids = NULL;
+  delete api_state->names;
+  api_state->names = NULL;
+  if (api_state->view) {
+    view_release(api_state->view);
+    api_state->view = NULL;
+  }
+}
+
+static void
+stats_cleanup(TSCont contp, intercept_state * api_state)
+{
+  if (api_state->req_buffer) {
+    TSIOBufferDestroy(api_state->req_buffer);
+    api_state->req_buffer = NULL;
+  }
+
+  if (api_state->resp_buffer) {
+    TSIOBufferDestroy(api_state->resp_buffer);
+    api_state->resp_buffer = NULL;
+  }
+
+  if (api_state->pending)
+    TSActionCancel(api_state->pending);
+  if (api_state->job)
+    render_job_abort(api_state->job);
+
+  json_out_free(api_state);
+  TSfree(api_state->if_none_match);
+  TSfree(api_state->channel);
+  TSfree(api_state->prefix);
+  TSfree(api_state->suffix);
+  TSVConnClose(api_state->net_vc);
+  TSfree(api_state);
+  TSContDestroy(contp);
+}
+
+static void
+stats_process_accept(TSCont contp, intercept_state * api_state)
+{
+
+  api_state->req_buffer = TSIOBufferCreate();
+  api_state->resp_buffer = TSIOBufferCreate();
+  api_state->resp_reader = TSIOBufferReaderAlloc(api_state->resp_buffer);
+  api_state->read_vio = TSVConnRead(api_state->net_vc, contp, api_state->req_buffer, INT64_MAX);
+}
+
+static int64_t
+stats_add_data_to_resp_buffer(const char *s, intercept_state * api_state)
+{
+  int64_t s_len = strlen(s);
+
+  TSIOBufferWrite(api_state->resp_buffer, s, s_len);
+
+  return s_len;
+}
+
+static const char RESP_HEADER[] =
+  "HTTP/1.0 200 Ok\r\nContent-Type: application/json\r\nCache-Control: no-cache\r\n\r\n";
+static const char PROMETHEUS_RESP_HEADER[] =
+  "HTTP/1.0 200 Ok\r\nContent-Type: text/plain; version=0.0.4\r\nCache-Control: no-cache\r\n\r\n";
+static const char BIN_RESP_HEADER[] =
+  "HTTP/1.0 200 Ok\r\nContent-Type: application/octet-stream\r\nCache-Control: no-cache\r\n\r\n";
+
+static int64_t
+stats_add_resp_header(intercept_state * api_state)
+{
+  if (api_state->deny)
+    return stats_add_data_to_resp_buffer(RESP_HEADER, api_state);
+
+  switch (api_state->format) {
+  case FORMAT_PROMETHEUS:
+    return stats_add_data_to_resp_buffer(PROMETHEUS_RESP_HEADER, api_state);
+  case FORMAT_BIN:
+    return stats_add_data_to_resp_buffer(BIN_RESP_HEADER, api_state);
+  default:
+    return stats_add_data_to_resp_buffer(RESP_HEADER, api_state);
+  }
+}
+
+static void
+stats_process_read(TSCont contp, TSEvent event, intercept_state * api_state)
+{
+  debug_api("stats_process_read(%d)", event);
+  if (event == TS_EVENT_VCONN_READ_READY) {
+    // body is complete if it's from snapshot, else it's written by steps
+    // or rendered by tasks
+    if (!stats_add_snapshot(api_state)) {
+      api_state->output_bytes = stats_add_resp_header(api_state);
+      render_start(contp, api_state);
+    }
+    TSVConnShutdown(api_state->net_vc, 1, 0);
+    api_state->write_vio = TSVConnWrite(api_state->net_vc, contp, api_state->resp_reader,
+                                        api_state->body_written ? api_state->output_bytes : INT64_MAX);
+  } else if (event == TS_EVENT_ERROR) {
+    error_api("stats_process_read: Received TS_EVENT_ERROR\n");
+  } else if (event == TS_EVENT_VCONN_EOS) {
+    // client may end the connection, simply return
+    return;
+  } else if (event == TS_EVENT_NET_ACCEPT_FAILED) {
+    error_api("stats_process_read: Received TS_EVENT_NET_ACCEPT_FAILED\n");
+  } else {
+    error_api("Unexpected Event %d\n", event);
+    // TSReleaseAssert(!"Unexpected Event");
+  }
+}
+
+#define APPEND(a) api_state->output_bytes += stats_add_data_to_resp_buffer(a, api_state)
+#define APPEND_STAT(a, fmt, v) do { \
+  char b[256]; \
+  if(snprintf(b, sizeof(b), "\"%s\": \"" fmt "\",\n", a, v) < (signed)sizeof(b)) \
+    APPEND(b); \
+} while(0)
+#define APPEND_END_STAT(a, fmt, v) do { \
+  char b[256]; \
+  if(snprintf(b, sizeof(b), "\"%s\": \"" fmt "\"\n", a, v) < (signed)sizeof(b)) \
+    APPEND(b); \
+} while(0)
+#define APPEND_DICT_NAME(a) do { \
+  char b[256]; \
+  if(snprintf(b, sizeof(b), "\"%s\": {\n", a) < (signed)sizeof(b)) \
+    APPEND(b); \
+} while(0)
+
+static void
+json_out_stat(TSRecordType rec_type, void *edata, int registered,
+              const char *name, TSRecordDataType data_type,
+              TSRecordData *datum) {
+  intercept_state *api_state = (intercept_state *) edata;
+
+  switch(data_type) {
+  case TS_RECORDDATATYPE_COUNTER:
+    APPEND_STAT(name, "%" PRId64, datum->rec_counter); break;
+  case TS_RECORDDATATYPE_INT:
+    APPEND_STAT(name, "%" PRIu64, datum->rec_int); break;
+  case TS_RECORDDATATYPE_FLOAT:
+    APPEND_STAT(name, "%f", datum->rec_float); break;
+  case TS_RECORDDATATYPE_STRING:
+    APPEND_STAT(name, "%s", datum->rec_string); break;
+  default:
+    debug_api("unkown type for %s: %d", name, data_type);
+    break;
+  }
+}
+
+// append "<prefix>.p50" ... of histogram, values are multiplied by scale
+template<class H>
+static void
+append_quantiles(intercept_state * api_state, const char * prefix,
+                 const H & hist, uint64_t scale, int is_last)
+{
+  int n = sizeof(quantiles) / sizeof(quantiles[0]);
+  uint64_t total = hist.total();
+  char name[128];
+
+  for (int i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "%s.%s", prefix, quantiles[i].name);
+    if (is_last && i == n - 1)
+      APPEND_END_STAT(name, "%" PRIu64, hist.quantile(quantiles[i].q, total) * scale);
+    else
+      APPEND_STAT(name, "%" PRIu64, hist.quantile(quantiles[i].q, total) * scale);
+  }
+}
+
+static void
+append_rates(intercept_state * api_state, const channel_rates * r, int is_last)
+{
+  int n = sizeof(rate_windows) / sizeof(rate_windows[0]);
+  uint32_t now = TShrtime() / HRTIME_SECOND;
+  char name[64];
+
+  for (int i = 0; i < n; i++) {
+    uint32_t window = rate_windows[i].seconds;
+    rate_bucket total;
+    memset(&total, 0, sizeof(total));
+    if (window < channel_rates::SECONDS) // sliding by second
+      r->sum_seconds(now, window, &total);
+    else
+      r->sum_minutes(now, window / 60, &total);
+
+    snprintf(name, sizeof(name), "rate.%s.requests_per_sec", rate_windows[i].name);
+    APPEND_STAT(name, "%.2f", (double) total.requests / window);
+    snprintf(name, sizeof(name), "rate.%s.bytes_per_sec", rate_windows[i].name);
+    APPEND_STAT(name, "%.2f", (double) total.bytes / window);
+    snprintf(name, sizeof(name), "rate.%s.5xx_per_sec", rate_windows[i].name);
+    if (is_last && i == n - 1)
+      APPEND_END_STAT(name, "%.2f", (double) total.count_5xx / window);
+    else
+      APPEND_STAT(name, "%.2f", (double) total.count_5xx / window);
+  }
+}
+
+static void
+append_histograms(intercept_state * api_state, const channel_histograms * hists)
+{
+  append_quantiles(api_state, "txn.duration_ms", hists->duration, 1, 0);
+  append_quantiles(api_state, "speed.ua.bytes_per_sec", hists->speed, 1024, 1);
+}
+
+/*
+  append stat of one channel without the trailing newline, with the
+  fields of the request only, caller appends ",\n" or "\n" to separate
+  channels
+*/
+static void
+append_channel_stat(intercept_state * api_state, channel_id id,
+                    const char * name, const channel_stat * cs)
+{
+  uint64_t fields = api_state->fields;
+  bool with_rates = rates && (fields & FIELD_RATES);
+  bool with_histograms = histograms && (fields & FIELD_HISTOGRAMS);
+  int last = NUM_CHANNEL_METRICS - 1;
+
+  while (last >= 0 && !(fields & FIELD_METRIC(last)))
+    last--;
+  APPEND_DICT_NAME(name);
+  for (int m = 0; m <= last; m++) {
+    if (!(fields & FIELD_METRIC(m)))
+      continue;
+    if (m < last || with_rates || with_histograms)
+      APPEND_STAT(channel_metrics[m].name, "%" PRIu64, cs->*channel_metrics[m].field);
+    else
+      APPEND_END_STAT(channel_metrics[m].name, "%" PRIu64, cs->*channel_metrics[m].field);
+  }
+  if (with_rates)
+    append_rates(api_state, &rates[id], !with_histograms);
+  if (with_histograms)
+    append_histograms(api_state, &histograms[id]);
+  APPEND("}");
+}
+
+static bool
+has_name_filter(const intercept_state * api_state)
+{
+  return api_state->channel[0] || api_state->prefix[0] || api_state->suffix[0];
+}
+
+// whether a channel is output, it's not if it's evicted
+static bool
+channel_match(const intercept_state * api_state, channel_id id)
+{
+  char name[MAX_HOST_LEN];
+  size_t len;
+  uint32_t tag = registry.tag(id);
+
+  if (!channel_registry::is_live(tag))
+    return false;
+  if (api_state->since > 0 &&
+      __atomic_load_n(&channel_generations[id], __ATOMIC_RELAXED) < api_state->since)
+    return false;
+  if (!has_name_filter(api_state))
+    return true;
+  len = registry.copy_name(id, tag, name, sizeof(name));
+  if (len == 0)
+    return false;
+  if (api_state->channel[0] &&
+      !memmem(name, len, api_state->channel, strlen(api_state->channel)))
+    return false;
+  if (api_state->prefix[0] &&
+      !filter_match_prefix(name, len, api_state->prefix, strlen(api_state->prefix)))
+    return false;
+  if (api_state->suffix[0] &&
+      !filter_match_domain(name, len, api_state->suffix, strlen(api_state->suffix)))
+    return false;
+  return true;
+}
+
+// take candidates of a name filter from filter index, if it can tell
+static void
+start_filter(intercept_state * api_state)
+{
+  std::vector<channel_id> *ids = new std::vector<channel_id>;
+  bool indexed = true;
+
+  TSMutexLock(filter_index_mutex);
+  if (api_state->suffix[0])
+    filter_index->find_domain(api_state->suffix, strlen(api_state->suffix), api_state->count, ids);
+  else
+    indexed = filter_index->find_substring(api_state->prefix, strlen(api_state->prefix), true,
+                                           api_state->count, ids) ||
+              filter_index->find_substring(api_state->channel, strlen(api_state->channel), false,
+                                           api_state->count, ids);
+  TSMutexUnlock(filter_index_mutex);
+
+  if (indexed) {
+    debug_api("filter index: %u candidates", (uint32_t) ids->size());
+    api_state->ids = ids;
+  } else {
+    delete ids; // too short, scan all
+  }
+}
+
+// take channels and generation of an output, channels added later are
+// left to the next one
+static void
+start_output(intercept_state * api_state)
+{
+  if (counters_type == COUNTERS_EPOCH) {
+    // the epoch task bumps the generation
+    api_state->view = view_acquire();
+    api_state->count = api_state->view->count;
+    api_state->generation = api_state->view->generation;
+  } else {
+    api_state->count = registry.size();
+    if (api_state->snapshot)
+      api_state->generation = __atomic_load_n(&globals->generation, __ATOMIC_ACQUIRE);
+    else
+      api_state->generation = __sync_add_and_fetch(&globals->generation, 1); // a full fence
+  }
+  if (filter_index && api_state->format != FORMAT_BIN && has_name_filter(api_state))
+    start_filter(api_state);
+}
+
+// number of channels to scan by cursor, see next_channel()
+static inline channel_id
+scan_end(const intercept_state * api_state)
+{
+  if (api_state->shard_end)
+    return api_state->shard_end;
+  return api_state->ids ? api_state->ids->size() : api_state->count;
+}
+
+// channel at cursor, ids are dense unless the filter index gave candidates
+static inline channel_id
+next_channel(intercept_state * api_state)
+{
+  channel_id i = api_state->cursor++;
+  return api_state->ids ? (*api_state->ids)[i] : i;
+}
+
+static bool
+step_is_full(const intercept_state * api_state, int64_t start, uint32_t work)
+{
+  return api_state->output_bytes - start >= API_CHUNK_SIZE || work >= API_SCAN_STEP;
+}
+
+/*
+  Top cache: with --top-interval, the TOP_CACHE_SIZE best channels of
+  each ranking are found every interval by one pass on a task thread, so
+  a topn request for up to TOP_CACHE_SIZE channels without channel or
+  since parameter takes n channels from it in O(n), instead of scanning
+  all channels. Their stats are read again, so values are current and
+  only the choice of channels is up to an interval old.
+*/
+#define TOP_CACHE_SIZE 1000
+
+struct top_cache {
+  stats_vec_t top[NUM_RANKINGS]; // best first
+};
+
+static int top_interval = 0; // seconds, 0 means no top cache
+static TSMutex top_cache_mutex;
+static top_cache *top_cached = NULL; // guarded by top_cache_mutex
+
+static int
+top_handle_event(TSCont contp, TSEvent event, void *edata)
+{
+  top_cache *cache = new top_cache;
+  top_cache *old;
+  counters_view *view = counters_type == COUNTERS_EPOCH ? view_acquire() : NULL;
+  uint32_t count = view ? view->count : registry.size();
+  channel_stat sum;
+
+  for (int r = 0; r < NUM_RANKINGS; r++)
+    cache->top[r].reserve(std::min(count, (uint32_t) TOP_CACHE_SIZE));
+  for (channel_id id = 0; id < count; id++) {
+    if (!channel_registry::is_live(registry.tag(id)))
+      continue;
+    read_channel_stat(view, id, &sum);
+    for (int r = 0; r < NUM_RANKINGS; r++)
+      top_push(&cache->top[r], TOP_CACHE_SIZE, compare_stat(rankings[r].field, false),
+               data_pair(id, sum));
+  }
+  for (int r = 0; r < NUM_RANKINGS; r++)
+    std::sort_heap(cache->top[r].begin(), cache->top[r].end(),
+                   compare_stat(rankings[r].field, false));
+  if (view)
+    view_release(view);
+
+  TSMutexLock(top_cache_mutex);
+  old = top_cached;
+  top_cached = cache;
+  TSMutexUnlock(top_cache_mutex);
+  delete old;
+
+  debug_api("top cache updated, %u channels", count);
+  TSContSchedule(contp, top_interval * 1000, TS_THREAD_POOL_TASK);
+  return 0;
+}
+
+// fill top list of topn request from top cache, false if it can't be used
+static bool
+top_cache_get(intercept_state * api_state)
+{
+  stats_vec_t *top = api_state->top;
+  int r = ranking_of(api_state->sort);
+
+  if (api_state->topn < 0 || api_state->topn > TOP_CACHE_SIZE || r < 0 ||
+      api_state->ascending || has_name_filter(api_state) || api_state->since > 0)
+    return false;
+
+  TSMutexLock(top_cache_mutex);
+  if (!top_cached) {
+    TSMutexUnlock(top_cache_mutex);
+    return false;
+  }
+  const stats_vec_t &cached = top_cached->top[r];
+  top->assign(cached.begin(), cached.begin() + std::min((size_t) api_state->topn, cached.size()));
+  TSMutexUnlock(top_cache_mutex);
+
+  for (stats_vec_t::iterator it = top->begin(); it != top->end(); ++it)
+    read_channel_stat(api_state->view, it->first, &it->second);
+  std::stable_sort(top->begin(), top->end(), sort_compare(api_state));
+  return true;
+}
+
+// number of sorted channels to output, topn or all
+static inline size_t
+top_size(const intercept_state * api_state)
+{
+  return api_state->topn >= 0 ? (size_t) api_state->topn : api_state->count;
+}
+
+// prepare output of sorted channels, the topn best or all of them
+static void
+start_top(intercept_state * api_state)
+{
+  api_state->top = new stats_vec_t;
+  api_state->cursor = 0;
+  if (top_cache_get(api_state)) {
+    api_state->stage = API_STAGE_CHANNELS;
+  } else {
+    api_state->top->reserve(std::min(top_size(api_state), (size_t) api_state->count));
+    api_state->stage = API_STAGE_TOP_SCAN;
+  }
+}
+
+// scan channels into a heap of the topn channels by sort, its front is the least
+static void
+scan_top_channels(intercept_state * api_state, int64_t start, uint32_t * work)
+{
+  stats_vec_t *top = api_state->top;
+  compare_stat cmp = sort_compare(api_state);
+  channel_stat sum;
+
+  while (api_state->cursor < scan_end(api_state) && !step_is_full(api_state, start, *work)) {
+    channel_id id = next_channel(api_state);
+    (*work)++;
+    if (!channel_match(api_state, id))
+      continue;
+    read_channel_stat(api_state->view, id, &sum);
+    top_push(top, top_size(api_state), cmp, data_pair(id, sum));
+  }
+
+  if (api_state->cursor == scan_end(api_state)) {
+    std::sort_heap(top->begin(), top->end(), cmp); // best first
+    api_state->cursor = 0;
+    api_state->stage = API_STAGE_CHANNELS;
+  }
+}
 
-  if (start_time != 0 && end_time != 0 && end_time >= start_time) {
-    interval_time = end_time - start_time;
-  } else {
-    warning("invalid time, start: %" PRId64", end: %" PRId64"", start_time, end_time);
-    return 0;
+// output channels from cursor, the sorted top or all matching channels
+static void
+json_out_channel_stats(intercept_state * api_state, int64_t start, uint32_t * work)
+{
+  stats_vec_t *top = api_state->top;
+  channel_id end = top ? top->size() : scan_end(api_state);
+  channel_stat sum;
+  char name[MAX_HOST_LEN];
+
+  while (api_state->cursor < end && !step_is_full(api_state, start, *work)) {
+    channel_id id;
+    const channel_stat *cs;
+    (*work)++;
+    if (top) {
+      id = (*top)[api_state->cursor].first;
+      cs = &(*top)[api_state->cursor].second;
+      api_state->cursor++;
+    } else {
+      // ids are in order, counters and names are read sequentially
+      id = next_channel(api_state);
+      if (!channel_match(api_state, id))
+        continue;
+      read_channel_stat(api_state->view, id, &sum);
+      cs = &sum;
+    }
+    if (registry.copy_name(id, registry.tag(id), name, sizeof(name)) == 0)
+      continue; // evicted
+    if (api_state->channels_out++ > 0)
+      APPEND(",\n");
+    append_channel_stat(api_state, id, name, cs);
   }
 
-  if (interval_time == 0 || body_bytes == 0)
-    user_speed = MAX_SPEED;
-  else
-    user_speed = (uint64_t)((float)body_bytes / interval_time * HRTIME_SECOND);
+  if (api_state->cursor == end) {
+    if (api_state->channels_out > 0)
+      APPEND("\n");
+    api_state->cursor = 0;
+    api_state->stage = api_state->merged ? API_STAGE_MERGE : API_STAGE_GLOBAL;
+  }
+}
 
-  debug("start time: %" PRId64 "", start_time);
-  debug("end time: %" PRId64 "", end_time);
-  debug("interval time: %" PRId64 "", interval_time);
-  debug("interval seconds: %.5f", interval_time / (float)HRTIME_SECOND);
-  debug("speed bytes per second: %" PRIu64 "", user_speed);
+static void
+json_merge_histograms(intercept_state * api_state, uint32_t * work)
+{
+  channel_histograms *merged = api_state->merged;
 
-  return user_speed;
+  while (api_state->cursor < api_state->count && *work < API_SCAN_STEP) {
+    channel_id id = api_state->cursor++;
+    (*work)++;
+    merged->duration.merge(histograms[id].duration);
+    merged->speed.merge(histograms[id].speed);
+  }
+
+  if (api_state->cursor == api_state->count)
+    api_state->stage = API_STAGE_GLOBAL;
+}
+
+/* merged heavy hitter of all threads: a sketch which doesn't count it
+   may have seen it up to its least count, which is added to upper */
+struct hh_item {
+  uint64_t key;
+  uint64_t upper; // estimate, >= real
+  uint64_t lower; // <= real
+  uint64_t least; // of its sketch, before merge
+  const sketch_entry *entry; // name
+};
+
+static bool
+hh_item_key_less(const hh_item &lhs, const hh_item &rhs)
+{
+  return lhs.key < rhs.key;
+}
+
+static bool
+hh_item_upper_greater(const hh_item &lhs, const hh_item &rhs)
+{
+  return lhs.upper > rhs.upper;
 }
 
+// heavy hitters of a sketch kind, K at most by estimate, total of weights
 static void
-handle_txn_close(TSCont contp, TSHttpTxn txnp)
+merge_heavy_hitters(space_saving hh_sketches::*kind, std::vector<sketch_entry> *entries,
+                    std::vector<hh_item> *items, uint64_t *total)
 {
-  TSMBuffer bufp;
-  TSMLoc hdr_loc;
-  TSHttpStatus status_code;
-  int status_code_type;
-  uint64_t user_speed;
-  uint64_t body_bytes;
-  channel_stat *stat;
-  std::string host;
+  int n = get_num_sketches();
+  uint32_t used = 0;
+  uint64_t least_sum = 0;
+
+  *total = 0;
+  entries->resize((size_t) n * heavy_hitters_size);
+  items->clear();
+  for (int s = 0; s < n; s++) {
+    hh_sketches *hh = __atomic_load_n(&sketches[s], __ATOMIC_ACQUIRE);
+    if (!hh)
+      continue;
+    const space_saving &sketch = hh->*kind;
+    uint64_t least = sketch.least();
+    uint32_t got = sketch.read(&(*entries)[used]);
+    for (uint32_t i = used; i < used + got; i++) {
+      const sketch_entry &e = (*entries)[i];
+      hh_item item = {e.key, e.count, e.count - e.error, least, &e};
+      items->push_back(item);
+    }
+    used += got;
+    least_sum += least;
+    *total += sketch.total();
+  }
 
-  if (TSHttpTxnClientRespGet(txnp, &bufp, &hdr_loc) != TS_SUCCESS) {
-    debug("couldn't retrieve final response");
-    return;
+  // add up items of a same name
+  std::sort(items->begin(), items->end(), hh_item_key_less);
+  size_t out = 0;
+  for (size_t i = 0; i < items->size(); ) {
+    hh_item merged = (*items)[i];
+    uint64_t least_present = merged.least;
+    size_t j;
+    for (j = i + 1; j < items->size() && (*items)[j].key == merged.key; j++) {
+      merged.upper += (*items)[j].upper;
+      merged.lower += (*items)[j].lower;
+      least_present += (*items)[j].least;
+    }
+    merged.upper += least_sum - least_present;
+    (*items)[out++] = merged;
+    i = j;
   }
+  items->resize(out);
 
-  status_code = TSHttpHdrStatusGet(bufp, hdr_loc);
-  status_code_type = status_code / 100;
-  body_bytes = TSHttpTxnClientRespBodyBytesGet(txnp);
+  std::sort(items->begin(), items->end(), hh_item_upper_greater);
+  if (items->size() > heavy_hitters_size)
+    items->resize(heavy_hitters_size);
+}
 
-  __sync_fetch_and_add(&global_response_bytes_content, body_bytes);
-  if (status_code_type == 2)
-    __sync_fetch_and_add(&global_response_count_2xx_get, 1);
+static void
+json_out_heavy_hitters(intercept_state * api_state)
+{
+  static const struct {
+    const char *name;
+    space_saving hh_sketches::*kind;
+  } kinds[] = {
+    {"requests", &hh_sketches::requests},
+    {"bytes", &hh_sketches::bytes},
+  };
+  std::vector<sketch_entry> entries;
+  std::vector<hh_item> items;
+  uint64_t totals[2];
+  char name[SKETCH_NAME_LEN + 1];
+
+  APPEND(" \"heavy_hitters\": {\n");
+  for (int k = 0; k < 2; k++) {
+    merge_heavy_hitters(kinds[k].kind, &entries, &items, &totals[k]);
+    APPEND_DICT_NAME(kinds[k].name);
+    for (size_t i = 0; i < items.size(); i++) {
+      memcpy(name, items[i].entry->name, items[i].entry->name_len);
+      name[items[i].entry->name_len] = '\0';
+      APPEND_DICT_NAME(name);
+      APPEND_STAT("estimate", "%" PRIu64, items[i].upper);
+      APPEND_END_STAT("error", "%" PRIu64, items[i].upper - items[i].lower);
+      APPEND(i + 1 < items.size() ? "},\n" : "}\n");
+    }
+    APPEND("},\n");
+  }
+  APPEND_STAT("total.requests", "%" PRIu64, totals[0]);
+  APPEND_STAT("total.bytes", "%" PRIu64, totals[1]);
+  APPEND_STAT("error.max.requests", "%" PRIu64, totals[0] / heavy_hitters_size);
+  APPEND_END_STAT("error.max.bytes", "%" PRIu64, totals[1] / heavy_hitters_size);
+  APPEND("  },\n");
+}
 
-  debug("body bytes: %" PRIu64 "", body_bytes);
-  debug("2xx req count: %" PRIu64 "", global_response_count_2xx_get);
+static void
+json_out_global_stats(intercept_state * api_state)
+{
+  const char *version;
+  uint64_t response_count_2xx_get;
+  uint64_t response_bytes_content;
 
-  if (!get_pristine_host(txnp, bufp, host))
-    goto cleanup;
+  APPEND("  },\n");
 
-  // get or create the stat
-  if (!get_channel_stat(host, stat, status_code_type))
-    goto cleanup;
+  if (heavy_hitters_size)
+    json_out_heavy_hitters(api_state);
+
+  read_global_stats(api_state->view, &response_count_2xx_get, &response_bytes_content);
+  APPEND(" \"global\": {\n");
+  APPEND_STAT("response.count.2xx.get", "%" PRIu64, response_count_2xx_get);
+  APPEND_STAT("response.bytes.content", "%" PRIu64, response_bytes_content);
+  APPEND_STAT("channel.count", "%u", api_state->view ? api_state->view->live : registry.live_size());
+  api_state->generation_begin = api_state->output_bytes;
+  APPEND_STAT("generation", "%" PRIu64, api_state->generation);
+  api_state->generation_end = api_state->output_bytes;
+
+  if (evict_idle > 0) {
+    channel_stat evicted;
+    uint64_t channels;
+    char name[128];
+    read_evicted_stats(api_state->view, &evicted, &channels);
+    APPEND_STAT("evicted.channel.count", "%" PRIu64, channels);
+    for (int m = 0; m < NUM_CHANNEL_METRICS; m++) {
+      snprintf(name, sizeof(name), "evicted.%s", channel_metrics[m].name);
+      APPEND_STAT(name, "%" PRIu64, evicted.*channel_metrics[m].field);
+    }
+  }
 
-  user_speed = get_txn_user_speed(txnp, body_bytes);
+  if (api_state->merged) {
+    append_quantiles(api_state, "txn.duration_ms", api_state->merged->duration, 1, 0);
+    append_quantiles(api_state, "speed.ua.bytes_per_sec", api_state->merged->speed, 1024, 0);
+  }
 
-  stat->increment(body_bytes,
-                  status_code_type == 2 ? 1 : 0,
-                  status_code_type == 5 ? 1 : 0,
-                  (user_speed < 64000 && user_speed > 0) ? 1 : 0);
-  stat->debug_channel();
+  if (api_state->show_global)
+    TSRecordDump(TS_RECORDTYPE_PROCESS, json_out_stat, api_state); // internal stats
 
-cleanup:
-  TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+  version = TSTrafficServerVersionGet();
+  APPEND("\"server\": \"");
+  APPEND(version);
+  APPEND("\"\n");
+
+  APPEND("  }\n}\n");
+  api_state->stage = API_STAGE_DONE;
 }
 
+// append next part of the stats, return 1 if all is appended
 static int
-handle_event(TSCont contp, TSEvent event, void *edata) {
-  TSHttpTxn txnp = (TSHttpTxn) edata;
+json_out_stats_step(intercept_state * api_state)
+{
+  int64_t start = api_state->output_bytes;
+  uint32_t work = 0;
+
+  while (api_state->stage != API_STAGE_DONE && !step_is_full(api_state, start, work)) {
+    switch (api_state->stage) {
+    case API_STAGE_START:
+      debug("appending channel stats");
+      APPEND("{ \"channel\": {\n");
+      start_output(api_state);
+      if (histograms) {
+        api_state->merged = (channel_histograms *) TSmalloc(sizeof(channel_histograms));
+        memset(api_state->merged, 0, sizeof(channel_histograms));
+      }
+      if (api_state->topn == 0 || api_state->count == 0) {
+        api_state->stage = api_state->merged ? API_STAGE_MERGE : API_STAGE_GLOBAL;
+      } else if (is_sorted_output(api_state)) {
+        start_top(api_state);
+      } else {
+        api_state->stage = API_STAGE_CHANNELS;
+      }
+      break;
+    case API_STAGE_TOP_SCAN:
+      scan_top_channels(api_state, start, &work);
+      break;
+    case API_STAGE_CHANNELS:
+      json_out_channel_stats(api_state, start, &work);
+      break;
+    case API_STAGE_MERGE:
+      json_merge_histograms(api_state, &work);
+      break;
+    case API_STAGE_GLOBAL:
+      json_out_global_stats(api_state);
+      break;
+    }
+  }
 
-  switch (event) {
-    case TS_EVENT_HTTP_READ_REQUEST_HDR: // for global contp
-      debug("---------- new request ----------");
-      handle_read_req(contp, txnp);
+  return api_state->stage == API_STAGE_DONE;
+}
+
+/*
+  Prometheus text exposition (?format=prometheus): samples of a metric
+  must be grouped, so channels are walked once per metric, reading one
+  counter column at a time. Lines are built in a small buffer by hand,
+  without snprintf, and written to the response when it's full.
+*/
+struct text_out {
+  intercept_state *api_state;
+  int len;
+  char buf[4096];
+};
+
+static void
+text_flush(text_out * out)
+{
+  if (out->len == 0)
+    return;
+  TSIOBufferWrite(out->api_state->resp_buffer, out->buf, out->len);
+  out->api_state->output_bytes += out->len;
+  out->len = 0;
+}
+
+static inline void
+text_append(text_out * out, const char * s, size_t len)
+{
+  if (out->len + len > sizeof(out->buf)) {
+    text_flush(out);
+    if (len > sizeof(out->buf)) {
+      TSIOBufferWrite(out->api_state->resp_buffer, s, len);
+      out->api_state->output_bytes += len;
+      return;
+    }
+  }
+  memcpy(out->buf + out->len, s, len);
+  out->len += len;
+}
+
+static inline void
+text_append_str(text_out * out, const char * s)
+{
+  text_append(out, s, strlen(s));
+}
+
+static inline void
+text_append_u64(text_out * out, uint64_t v)
+{
+  char digits[20]; // max uint64 has 20 digits
+  char *p = digits + sizeof(digits);
+
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  text_append(out, p, digits + sizeof(digits) - p);
+}
+
+// label value, with \, " and newline escaped
+static void
+text_append_label(text_out * out, const char * s, size_t len)
+{
+  size_t from = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] != '\\' && s[i] != '"' && s[i] != '\n')
+      continue;
+    text_append(out, s + from, i - from);
+    text_append(out, s[i] == '\n' ? "\\n" : s[i] == '"' ? "\\\"" : "\\\\", 2);
+    from = i + 1;
+  }
+  text_append(out, s + from, len - from);
+}
+
+static void
+text_append_family(text_out * out, const char * name, const char * help, const char * type)
+{
+  text_append_str(out, "# HELP ");
+  text_append_str(out, name);
+  text_append(out, " ", 1);
+  text_append_str(out, help);
+  text_append_str(out, "\n# TYPE ");
+  text_append_str(out, name);
+  text_append(out, " ", 1);
+  text_append_str(out, type);
+  text_append(out, "\n", 1);
+}
+
+static void
+text_append_sample(text_out * out, const char * name, uint64_t value)
+{
+  text_append_str(out, name);
+  text_append(out, " ", 1);
+  text_append_u64(out, value);
+  text_append(out, "\n", 1);
+}
+
+static bool
+prometheus_step_is_full(const text_out * out, int64_t start, uint32_t work)
+{
+  return out->api_state->output_bytes + out->len - start >= API_CHUNK_SIZE ||
+         work >= API_SCAN_STEP;
+}
+
+// sample of metric m for channel id, nothing if it's evicted
+static void
+prometheus_out_channel_sample(text_out * out, int m, channel_id id, uint64_t value)
+{
+  char name[MAX_HOST_LEN];
+  size_t len = registry.copy_name(id, registry.tag(id), name, sizeof(name));
+
+  if (len == 0)
+    return;
+  text_append_str(out, channel_metrics[m].prometheus_name);
+  text_append_str(out, "{channel=\"");
+  text_append_label(out, name, len);
+  text_append(out, "\"} ", 3);
+  text_append_u64(out, value);
+  text_append(out, "\n", 1);
+}
+
+// sample of metric m for all evicted channels, as one more series
+static void
+prometheus_out_evicted_sample(text_out * out, const counters_view * view, int m)
+{
+  channel_stat evicted;
+  uint64_t channels;
+
+  read_evicted_stats(view, &evicted, &channels);
+  text_append_str(out, channel_metrics[m].prometheus_name);
+  text_append_str(out, "{evicted=\"true\"} ");
+  text_append_u64(out, evicted.*channel_metrics[m].field);
+  text_append(out, "\n", 1);
+}
+
+// output metrics from (metric, cursor), for the sorted top or all matching channels
+static void
+prometheus_out_channel_stats(text_out * out, int64_t start, uint32_t * work)
+{
+  intercept_state *api_state = out->api_state;
+  int n = NUM_CHANNEL_METRICS;
+  stats_vec_t *top = api_state->top;
+  channel_id end = top ? top->size() : scan_end(api_state);
+
+  while (api_state->metric < n && !prometheus_step_is_full(out, start, *work)) {
+    int m = api_state->metric;
+    if (!(api_state->fields & FIELD_METRIC(m))) {
+      api_state->metric++;
+      continue;
+    }
+    if (api_state->cursor == 0)
+      text_append_family(out, channel_metrics[m].prometheus_name, channel_metrics[m].help, "counter");
+
+    while (api_state->cursor < end && !prometheus_step_is_full(out, start, *work)) {
+      channel_id id;
+      uint64_t value;
+      (*work)++;
+      if (top) {
+        id = (*top)[api_state->cursor].first;
+        value = (*top)[api_state->cursor].second.*channel_metrics[m].field;
+        api_state->cursor++;
+      } else {
+        id = next_channel(api_state);
+        if (!channel_match(api_state, id))
+          continue;
+        value = read_channel_counter(api_state->view, id, channel_metrics[m].column);
+      }
+      prometheus_out_channel_sample(out, m, id, value);
+    }
+
+    if (api_state->cursor == end) {
+      if (evict_idle > 0)
+        prometheus_out_evicted_sample(out, api_state->view, m);
+      api_state->metric++;
+      api_state->cursor = 0;
+    }
+  }
+
+  if (api_state->metric == n)
+    api_state->stage = API_STAGE_GLOBAL;
+}
+
+static void
+prometheus_out_stat(TSRecordType rec_type, void *edata, int registered,
+                    const char *name, TSRecordDataType data_type,
+                    TSRecordData *datum)
+{
+  text_out *out = (text_out *) edata;
+  char metric[256];
+  char value[64];
+  size_t i;
+
+  // proxy.process.http.foo -> proxy_process_http_foo, untyped
+  for (i = 0; name[i] && i < sizeof(metric) - 1; i++)
+    metric[i] = isalnum((unsigned char) name[i]) ? name[i] : '_';
+  metric[i] = '\0';
+
+  switch(data_type) {
+  case TS_RECORDDATATYPE_COUNTER:
+    snprintf(value, sizeof(value), "%" PRId64, datum->rec_counter); break;
+  case TS_RECORDDATATYPE_INT:
+    snprintf(value, sizeof(value), "%" PRId64, datum->rec_int); break;
+  case TS_RECORDDATATYPE_FLOAT:
+    snprintf(value, sizeof(value), "%f", datum->rec_float); break;
+  default:
+    return; // strings have no sample value
+  }
+  text_append_str(out, metric);
+  text_append(out, " ", 1);
+  text_append_str(out, value);
+  text_append(out, "\n", 1);
+}
+
+static void
+prometheus_out_global_stats(text_out * out)
+{
+  uint64_t response_count_2xx_get;
+  uint64_t response_bytes_content;
+
+  const counters_view *view = out->api_state->view;
+
+  read_global_stats(view, &response_count_2xx_get, &response_bytes_content);
+  text_append_family(out, "channel_stats_global_response_count_2xx_get_total",
+                     "2xx transaction count of all channels", "counter");
+  text_append_sample(out, "channel_stats_global_response_count_2xx_get_total",
+                     response_count_2xx_get);
+  text_append_family(out, "channel_stats_global_response_bytes_content_total",
+                     "Transferred content length of all channels", "counter");
+  text_append_sample(out, "channel_stats_global_response_bytes_content_total",
+                     response_bytes_content);
+  text_append_family(out, "channel_stats_channel_count", "Number of channels", "gauge");
+  text_append_sample(out, "channel_stats_channel_count", view ? view->live : registry.live_size());
+  if (evict_idle > 0) {
+    channel_stat evicted;
+    uint64_t channels;
+    read_evicted_stats(view, &evicted, &channels);
+    text_append_family(out, "channel_stats_evicted_channel_count_total",
+                       "Number of evicted channels", "counter");
+    text_append_sample(out, "channel_stats_evicted_channel_count_total", channels);
+  }
+  text_append_family(out, "channel_stats_generation",
+                     "Generation of this output, for since parameter", "gauge");
+  text_append_sample(out, "channel_stats_generation", out->api_state->generation);
+
+  if (out->api_state->show_global)
+    TSRecordDump(TS_RECORDTYPE_PROCESS, prometheus_out_stat, out); // internal stats
+
+  out->api_state->stage = API_STAGE_DONE;
+}
+
+// append next part of the stats, return 1 if all is appended
+static int
+prometheus_out_stats_step(intercept_state * api_state)
+{
+  text_out out;
+  int64_t start = api_state->output_bytes;
+  uint32_t work = 0;
+
+  out.api_state = api_state;
+  out.len = 0;
+
+  while (api_state->stage != API_STAGE_DONE && !prometheus_step_is_full(&out, start, work)) {
+    switch (api_state->stage) {
+    case API_STAGE_START:
+      start_output(api_state);
+      api_state->metric = 0;
+      if (api_state->topn == 0 || api_state->count == 0) {
+        api_state->stage = API_STAGE_GLOBAL;
+      } else if (is_sorted_output(api_state)) {
+        start_top(api_state);
+      } else {
+        api_state->stage = API_STAGE_CHANNELS;
+      }
       break;
-    case TS_EVENT_HTTP_TXN_CLOSE: // for txn contp
-      handle_txn_close(contp, txnp);
-      TSContDestroy(contp);
+    case API_STAGE_TOP_SCAN:
+      scan_top_channels(api_state, start, &work);
       break;
-    default:
-      error("unknown event for this plugin");
+    case API_STAGE_CHANNELS:
+      prometheus_out_channel_stats(&out, start, &work);
+      break;
+    case API_STAGE_GLOBAL:
+      prometheus_out_global_stats(&out);
+      break;
+    }
   }
 
-  TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
+  text_flush(&out);
+  return api_state->stage == API_STAGE_DONE;
+}
 
-  return 0;
+/*
+  Binary output (?format=bin), see channel_stats_bin.h. The string table
+  is the registry arena as is, a column is written a block of channels at
+  a time, so encoding is about a memcpy of the counter store. All channels
+  are written, topn and channel parameters are ignored. With eviction,
+  names are no longer in id order in the arena, the string table is a
+  copy of names, where evicted ids have an empty name.
+*/
+static const char bin_padding[CSTATS_BIN_ALIGN] = {0};
+
+static void
+bin_append(intercept_state * api_state, const void * data, size_t len)
+{
+  TSIOBufferWrite(api_state->resp_buffer, data, len);
+  api_state->output_bytes += len;
 }
 
-// below is api part
+static void
+bin_append_padding(intercept_state * api_state, uint64_t size)
+{
+  bin_append(api_state, bin_padding, cstats_bin_pad(size) - size);
+}
+
+// string table of channels [0, count), names is the copy with eviction
+static const char *
+bin_channel_names(channel_id count, std::string * names, size_t * size)
+{
+  char name[MAX_HOST_LEN];
+
+  if (evict_idle == 0)
+    return registry.names(count, size);
+
+  names->clear();
+  for (channel_id id = 0; id < count; id++) {
+    size_t len = registry.copy_name(id, registry.tag(id), name, sizeof(name));
+    names->append(name, len);
+    names->push_back('\0');
+  }
+  *size = names->size();
+  return names->data();
+}
+
+// header of binary output of count channels, return size of column names
+static uint32_t
+bin_make_header(cstats_bin_header * header, const counters_view * view,
+                channel_id count, uint64_t generation, size_t names_size)
+{
+  int n = NUM_CHANNEL_METRICS;
+  uint32_t column_names_size = 0;
+
+  for (int c = 0; c < n; c++)
+    column_names_size += strlen(channel_metrics[c].name) + 1;
+
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, CSTATS_BIN_MAGIC, sizeof(header->magic));
+  header->version = CSTATS_BIN_VERSION;
+  header->byte_order = CSTATS_BIN_BYTE_ORDER;
+  header->header_size = sizeof(*header);
+  header->num_channels = count;
+  header->num_columns = n;
+  header->column_names_size = cstats_bin_pad(column_names_size);
+  header->names_size = cstats_bin_pad(names_size);
+  read_global_stats(view, &header->response_count_2xx_get, &header->response_bytes_content);
+  header->generation = generation;
+  return column_names_size;
+}
 
 static void
-stats_cleanup(TSCont contp, intercept_state * api_state)
+bin_out_header(intercept_state * api_state)
 {
-  if (api_state->req_buffer) {
-    TSIOBufferDestroy(api_state->req_buffer);
-    api_state->req_buffer = NULL;
+  int n = NUM_CHANNEL_METRICS;
+  cstats_bin_header header;
+  size_t names_size;
+  uint32_t column_names_size;
+
+  if (evict_idle > 0)
+    api_state->names = new std::string;
+  bin_channel_names(api_state->count, api_state->names, &names_size);
+  column_names_size = bin_make_header(&header, api_state->view, api_state->count,
+                                      api_state->generation, names_size);
+
+  bin_append(api_state, &header, sizeof(header));
+
+  for (int c = 0; c < n; c++)
+    bin_append(api_state, channel_metrics[c].name, strlen(channel_metrics[c].name) + 1);
+  bin_append_padding(api_state, column_names_size);
+}
+
+// string table from cursor, a byte offset here
+static void
+bin_out_names(intercept_state * api_state, int64_t start)
+{
+  size_t names_size;
+  const char *names;
+
+  if (api_state->names) {
+    names = api_state->names->data();
+    names_size = api_state->names->size();
+  } else {
+    names = registry.names(api_state->count, &names_size);
   }
 
-  if (api_state->resp_buffer) {
-    TSIOBufferDestroy(api_state->resp_buffer);
-    api_state->resp_buffer = NULL;
+  while (api_state->cursor < names_size && api_state->output_bytes - start < API_CHUNK_SIZE) {
+    size_t len = std::min(names_size - api_state->cursor, (size_t) API_CHUNK_SIZE);
+    bin_append(api_state, names + api_state->cursor, len);
+    api_state->cursor += len;
   }
 
-  TSfree(api_state->channel);
-  TSVConnClose(api_state->net_vc);
-  TSfree(api_state);
-  TSContDestroy(contp);
+  if (api_state->cursor == names_size) {
+    bin_append_padding(api_state, names_size);
+    api_state->cursor = 0;
+    api_state->metric = 0;
+    api_state->stage = API_STAGE_CHANNELS;
+  }
+}
+
+// columns from (metric, cursor), up to a block of channels per write
+static void
+bin_out_columns(intercept_state * api_state, int64_t start)
+{
+  int n = NUM_CHANNEL_METRICS;
+  uint64_t sums[CHANNEL_BLOCK_SIZE];
+
+  while (api_state->metric < n && api_state->output_bytes - start < API_CHUNK_SIZE) {
+    channel_id first = api_state->cursor;
+    uint32_t len = std::min(CHANNEL_BLOCK_SIZE - channel_registry::slot(first),
+                            api_state->count - first);
+    if (len > 0) {
+      read_channel_counters(api_state->view, first, len, channel_metrics[api_state->metric].column,
+                            sums);
+      bin_append(api_state, sums, len * sizeof(uint64_t));
+      api_state->cursor += len;
+    }
+    if (api_state->cursor == api_state->count) {
+      api_state->metric++;
+      api_state->cursor = 0;
+    }
+  }
+
+  if (api_state->metric == n)
+    api_state->stage = API_STAGE_DONE;
+}
+
+// append next part of the stats, return 1 if all is appended
+static int
+bin_out_stats_step(intercept_state * api_state)
+{
+  int64_t start = api_state->output_bytes;
+
+  while (api_state->stage != API_STAGE_DONE && api_state->output_bytes - start < API_CHUNK_SIZE) {
+    switch (api_state->stage) {
+    case API_STAGE_START:
+      start_output(api_state);
+      bin_out_header(api_state);
+      api_state->cursor = 0;
+      api_state->stage = API_STAGE_NAMES;
+      break;
+    case API_STAGE_NAMES:
+      bin_out_names(api_state, start);
+      break;
+    case API_STAGE_CHANNELS:
+      bin_out_columns(api_state, start);
+      break;
+    }
+  }
+
+  return api_state->stage == API_STAGE_DONE;
+}
+
+/*
+  Snapshot: with --snapshot-interval, the output of a request without
+  parameters is rendered every interval on a task thread, and such
+  requests get the snapshot by TSIOBufferCopy, which shares its buffer
+  blocks instead of copying the bytes. The renderer replaces the
+  snapshot, the last request holding the old one frees it. ETag is a
+  hash of the body but its generation, so while stats don't change a
+  scraper sending If-None-Match gets a 304 without body. A render reads
+  the generation without bumping it: since=<it> may return channels
+  counted just before it, never miss one.
+*/
+struct stats_snapshot {
+  int refcount;
+  TSIOBuffer buffer;
+  TSIOBufferReader reader;
+  int64_t size;
+  char etag[24]; // "16 hex digits", with quotes
+};
+
+static int snapshot_interval = 0; // seconds, 0 means no snapshot
+static TSMutex snapshot_mutex;
+static stats_snapshot *snapshot = NULL; // current, guarded by snapshot_mutex
+
+static stats_snapshot *
+snapshot_acquire()
+{
+  stats_snapshot *s;
+
+  TSMutexLock(snapshot_mutex);
+  s = snapshot;
+  if (s)
+    __sync_fetch_and_add(&s->refcount, 1);
+  TSMutexUnlock(snapshot_mutex);
+  return s;
 }
 
 static void
-stats_process_accept(TSCont contp, intercept_state * api_state)
+snapshot_release(stats_snapshot *s)
 {
+  if (__sync_sub_and_fetch(&s->refcount, 1) > 0)
+    return;
+  TSIOBufferReaderFree(s->reader);
+  TSIOBufferDestroy(s->buffer);
+  TSfree(s);
+}
 
-  api_state->req_buffer = TSIOBufferCreate();
-  api_state->resp_buffer = TSIOBufferCreate();
-  api_state->resp_reader = TSIOBufferReaderAlloc(api_state->resp_buffer);
-  api_state->read_vio = TSVConnRead(api_state->net_vc, contp, api_state->req_buffer, INT64_MAX);
+// 64-bit FNV-1a of all bytes readable by reader, but those from skip to skip_end
+static uint64_t
+snapshot_hash(TSIOBufferReader reader, int64_t skip, int64_t skip_end)
+{
+  uint64_t h = 14695981039346656037ULL;
+  TSIOBufferBlock block = TSIOBufferReaderStart(reader);
+  int64_t avail, offset = 0;
+
+  for (; block; block = TSIOBufferBlockNext(block)) {
+    const char *p = TSIOBufferBlockReadStart(block, reader, &avail);
+    for (int64_t i = 0; i < avail; i++, offset++) {
+      if (offset >= skip && offset < skip_end)
+        continue;
+      h ^= (unsigned char) p[i];
+      h *= 1099511628211ULL;
+    }
+  }
+  return h;
+}
+
+static stats_snapshot *
+snapshot_render()
+{
+  intercept_state render;
+  stats_snapshot *s = (stats_snapshot *) TSmalloc(sizeof(*s));
+
+  memset(&render, 0, sizeof(render));
+  init_api_params(&render);
+  render.snapshot = 1;
+  render.channel = (char *) "";
+  render.prefix = (char *) "";
+  render.suffix = (char *) "";
+
+  s->refcount = 1;
+  s->buffer = render.resp_buffer = TSIOBufferCreate();
+  s->reader = TSIOBufferReaderAlloc(s->buffer); // before any write
+  while (!json_out_stats_step(&render))
+    ;
+  json_out_free(&render);
+
+  s->size = render.output_bytes;
+  snprintf(s->etag, sizeof(s->etag), "\"%016" PRIx64 "\"", snapshot_hash(s->reader, render.generation_begin, render.generation_end));
+  return s;
 }
 
 static int
-stats_add_data_to_resp_buffer(const char *s, intercept_state * api_state)
+snapshot_handle_event(TSCont contp, TSEvent event, void *edata)
 {
-  int s_len = strlen(s);
+  stats_snapshot *s = snapshot_render();
+  stats_snapshot *old;
+
+  TSMutexLock(snapshot_mutex);
+  old = snapshot;
+  snapshot = s;
+  TSMutexUnlock(snapshot_mutex);
+  if (old)
+    snapshot_release(old);
+
+  debug_api("snapshot rendered, %" PRId64 " bytes, etag %s", s->size, s->etag);
+  TSContSchedule(contp, snapshot_interval * 1000, TS_THREAD_POOL_TASK);
+  return 0;
+}
 
-  TSIOBufferWrite(api_state->resp_buffer, s, s_len);
+// write whole response from snapshot, return false if request can't use it
+static bool
+stats_add_snapshot(intercept_state * api_state)
+{
+  stats_snapshot *s;
+  char header[256];
 
-  return s_len;
-}
+  if (api_state->deny || api_state->show_global || api_state->topn != -1 ||
+      is_sorted_output(api_state) || api_state->fields != FIELDS_ALL ||
+      has_name_filter(api_state) || api_state->format != FORMAT_JSON ||
+      api_state->since > 0)
+    return false;
+  if (!(s = snapshot_acquire()))
+    return false; // not rendered yet
 
-static const char RESP_HEADER[] =
-  "HTTP/1.0 200 Ok\r\nContent-Type: application/json\r\nCache-Control: no-cache\r\n\r\n";
+  if (api_state->if_none_match && strstr(api_state->if_none_match, s->etag)) {
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 304 Not Modified\r\nETag: %s\r\n\r\n", s->etag);
+    api_state->output_bytes = stats_add_data_to_resp_buffer(header, api_state);
+  } else {
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 Ok\r\nContent-Type: application/json\r\n"
+             "Cache-Control: no-cache\r\nETag: %s\r\n"
+             "Content-Length: %" PRId64 "\r\n\r\n", s->etag, s->size);
+    api_state->output_bytes = stats_add_data_to_resp_buffer(header, api_state);
+    api_state->output_bytes += TSIOBufferCopy(api_state->resp_buffer, s->reader, s->size, 0);
+  }
 
-static int
-stats_add_resp_header(intercept_state * api_state)
-{
-  return stats_add_data_to_resp_buffer(RESP_HEADER, api_state);
+  snapshot_release(s);
+  api_state->body_written = 1;
+  return true;
 }
 
+/*
+  Parallel render: with --render-threads=N, a response of all matching
+  channels (json or prometheus, without topn) is rendered on task
+  threads instead of in steps on the net thread of the request, which
+  also serves txns. A task splits the channels to scan in up to N shards
+  of RENDER_SHARD_MIN channels at least, rendered in parallel by as many
+  tasks, each in its own buffer, and the last one done renders global
+  stats. The net thread then appends the buffers to the response by
+  reference, TSIOBufferCopy shares their blocks, with the few bytes which
+  join them: ",\n" between json shards, and for prometheus the family of
+  each metric before its samples from each shard. As a snapshot, the
+  whole body is held in memory until it's written.
+*/
+#define RENDER_SHARD_MIN 4096 // channels
+#define MAX_RENDER_THREADS 64
+
+static int render_threads = 0; // 0 means render in steps on the net thread
+static TSMutex render_mutex; // guards contp and done of all jobs
+
+struct render_shard {
+  render_job *job;
+  intercept_state state; // of the job, with its own buffer and channels
+  TSIOBufferReader reader;
+  channel_id begin; // cursor of its first channel
+  channel_histograms *merged; // json: histograms of its part of all channels
+  int64_t metric_end[NUM_CHANNEL_METRICS]; // prometheus: size after each metric
+};
+
+struct render_job {
+  int refcount; // the request and the render
+  int pending; // shards not rendered yet
+  TSCont contp; // of the request, NULL once it's gone
+  TSAction done; // event to contp once the body is rendered
+  intercept_state state; // of the output, global stats are rendered with it
+  TSIOBufferReader reader; // of global stats
+  int num_shards;
+  render_shard *shards;
+};
+
 static void
-stats_process_read(TSCont contp, TSEvent event, intercept_state * api_state)
+render_job_release(render_job * job)
 {
-  debug_api("stats_process_read(%d)", event);
-  if (event == TS_EVENT_VCONN_READ_READY) {
-    api_state->output_bytes = stats_add_resp_header(api_state);
-    TSVConnShutdown(api_state->net_vc, 1, 0);
-    api_state->write_vio = TSVConnWrite(api_state->net_vc, contp, api_state->resp_reader, INT64_MAX);
-  } else if (event == TS_EVENT_ERROR) {
-    error_api("stats_process_read: Received TS_EVENT_ERROR\n");
-  } else if (event == TS_EVENT_VCONN_EOS) {
-    // client may end the connection, simply return
+  if (__sync_sub_and_fetch(&job->refcount, 1) > 0)
     return;
-  } else if (event == TS_EVENT_NET_ACCEPT_FAILED) {
-    error_api("stats_process_read: Received TS_EVENT_NET_ACCEPT_FAILED\n");
-  } else {
-    error_api("Unexpected Event %d\n", event);
-    // TSReleaseAssert(!"Unexpected Event");
+  for (int i = 0; i < job->num_shards; i++) {
+    TSIOBufferReaderFree(job->shards[i].reader);
+    TSIOBufferDestroy(job->shards[i].state.resp_buffer);
+    TSfree(job->shards[i].merged);
   }
+  TSfree(job->shards);
+  TSIOBufferReaderFree(job->reader);
+  TSIOBufferDestroy(job->state.resp_buffer);
+  json_out_free(&job->state);
+  TSfree(job->state.channel);
+  TSfree(job->state.prefix);
+  TSfree(job->state.suffix);
+  TSfree(job);
 }
 
-#define APPEND(a) api_state->output_bytes += stats_add_data_to_resp_buffer(a, api_state)
-#define APPEND_STAT(a, fmt, v) do { \
-  char b[256]; \
-  if(snprintf(b, sizeof(b), "\"%s\": \"" fmt "\",\n", a, v) < (signed)sizeof(b)) \
-    APPEND(b); \
-} while(0)
-#define APPEND_END_STAT(a, fmt, v) do { \
-  char b[256]; \
-  if(snprintf(b, sizeof(b), "\"%s\": \"" fmt "\"\n", a, v) < (signed)sizeof(b)) \
-    APPEND(b); \
-} while(0)
-#define APPEND_DICT_NAME(a) do { \
-  char b[256]; \
-  if(snprintf(b, sizeof(b), "\"%s\": {\n", a) < (signed)sizeof(b)) \
-    APPEND(b); \
-} while(0)
-
+// the request is gone, the render goes on but nothing wakes it up
 static void
-json_out_stat(TSRecordType rec_type, void *edata, int registered,
-              const char *name, TSRecordDataType data_type,
-              TSRecordData *datum) {
-  intercept_state *api_state = (intercept_state *) edata;
+render_job_abort(render_job * job)
+{
+  TSMutexLock(render_mutex);
+  job->contp = NULL;
+  if (job->done)
+    TSActionCancel(job->done);
+  TSMutexUnlock(render_mutex);
+  render_job_release(job);
+}
 
-  switch(data_type) {
-  case TS_RECORDDATATYPE_COUNTER:
-    APPEND_STAT(name, "%" PRId64, datum->rec_counter); break;
-  case TS_RECORDDATATYPE_INT:
-    APPEND_STAT(name, "%" PRIu64, datum->rec_int); break;
-  case TS_RECORDDATATYPE_FLOAT:
-    APPEND_STAT(name, "%f", datum->rec_float); break;
-  case TS_RECORDDATATYPE_STRING:
-    APPEND_STAT(name, "%s", datum->rec_string); break;
-  default:
-    debug_api("unkown type for %s: %d", name, data_type);
-    break;
+// channel dicts as json_out_channel_stats() writes them, and histograms
+// of the shard's part of all channels
+static void
+json_render_shard(render_shard * shard)
+{
+  render_job *job = shard->job;
+  intercept_state *state = &shard->state;
+  int i = shard - job->shards;
+  channel_id from = (uint64_t) job->state.count * i / job->num_shards;
+  channel_id to = (uint64_t) job->state.count * (i + 1) / job->num_shards;
+  uint32_t work;
+
+  while (state->stage == API_STAGE_CHANNELS) {
+    work = 0;
+    json_out_channel_stats(state, state->output_bytes, &work);
+  }
+  for (channel_id id = from; shard->merged && id < to; id++) {
+    shard->merged->duration.merge(histograms[id].duration);
+    shard->merged->speed.merge(histograms[id].speed);
   }
 }
 
-template<class T>
-struct compare
-: std::binary_function<T,T,bool>
+// samples of the shard's channels, one metric after the other
+static void
+prometheus_render_shard(render_shard * shard)
 {
-   inline bool operator()(const T& lhs, const T& rhs) {
-      return lhs.second->response_count_2xx > rhs.second->response_count_2xx;
-   }
-};
+  intercept_state *state = &shard->state;
+  text_out out;
+
+  out.api_state = state;
+  out.len = 0;
+  for (int m = 0; m < NUM_CHANNEL_METRICS; m++) {
+    state->cursor = shard->begin;
+    while ((state->fields & FIELD_METRIC(m)) && state->cursor < scan_end(state)) {
+      channel_id id = next_channel(state);
+      if (channel_match(state, id))
+        prometheus_out_channel_sample(&out, m, id,
+                                      read_channel_counter(state->view, id, channel_metrics[m].column));
+    }
+    shard->metric_end[m] = state->output_bytes + out.len;
+  }
+  text_flush(&out);
+}
 
+// global stats, then wake the request up
 static void
-append_channel_stat(intercept_state * api_state,
-                    const std::string channel, channel_stat * cs,
-                    int is_last)
+render_finish(render_job * job)
 {
-  APPEND_DICT_NAME(channel.c_str());
-  APPEND_STAT("response.bytes.content", "%" PRIu64, cs->response_bytes_content);
-  APPEND_STAT("response.count.2xx.get", "%" PRIu64, cs->response_count_2xx);
-  APPEND_STAT("response.count.5xx.get", "%" PRIu64, cs->response_count_5xx);
-  APPEND_END_STAT("speed.ua.bytes_per_sec_64k", "%" PRIu64, cs->speed_ua_bytes_per_sec_64k);
-  if (is_last)
-    APPEND("}\n");
-  else
-    APPEND("},\n");
+  intercept_state *state = &job->state;
+
+  if (state->format == FORMAT_JSON) {
+    for (int i = 0; state->merged && i < job->num_shards; i++) {
+      state->merged->duration.merge(job->shards[i].merged->duration);
+      state->merged->speed.merge(job->shards[i].merged->speed);
+    }
+    json_out_global_stats(state);
+  } else {
+    text_out out;
+    out.api_state = state;
+    out.len = 0;
+    prometheus_out_global_stats(&out);
+    text_flush(&out);
+  }
+
+  TSMutexLock(render_mutex);
+  if (job->contp)
+    job->done = TSContSchedule(job->contp, 0, TS_THREAD_POOL_DEFAULT);
+  TSMutexUnlock(render_mutex);
+  render_job_release(job);
 }
 
 static void
-json_out_channel_stats(intercept_state * api_state) {
-  if (channel_stats.empty())
-    return;
+render_shard_run(render_shard * shard)
+{
+  if (shard->state.format == FORMAT_JSON)
+    json_render_shard(shard);
+  else
+    prometheus_render_shard(shard);
+  if (__sync_sub_and_fetch(&shard->job->pending, 1) == 0)
+    render_finish(shard->job);
+}
 
-  typedef std::pair<std::string, channel_stat *> data_pair;
-  typedef std::vector<data_pair> stats_vec_t;
-  smap_iterator it;
+static int
+render_shard_handle_event(TSCont contp, TSEvent event, void *edata)
+{
+  render_shard *shard = (render_shard *) TSContDataGet(contp);
 
-  debug("appending channel stats");
+  TSContDestroy(contp);
+  render_shard_run(shard);
+  return 0;
+}
 
-  if (api_state->topn > -1 ||
-      (api_state->channel && strlen(api_state->channel) > 0)) {
-    // will use vector to output
+// start the output, split its channels in shards, render the first one
+static int
+render_start_handle_event(TSCont contp, TSEvent event, void *edata)
+{
+  render_job *job = (render_job *) TSContDataGet(contp);
+  intercept_state *state = &job->state;
+  channel_id end;
+  int n;
 
-    if (api_state->topn == 0)
-      return;
+  TSContDestroy(contp);
+  start_output(state);
+  if (histograms && state->format == FORMAT_JSON) {
+    state->merged = (channel_histograms *) TSmalloc(sizeof(channel_histograms));
+    memset(state->merged, 0, sizeof(channel_histograms));
+  }
+  end = scan_end(state);
+  n = std::min((channel_id) render_threads, (end + RENDER_SHARD_MIN - 1) / RENDER_SHARD_MIN);
+  if (n == 0) {
+    // no channel to scan, global histograms are still of all channels
+    for (channel_id id = 0; state->merged && id < state->count; id++) {
+      state->merged->duration.merge(histograms[id].duration);
+      state->merged->speed.merge(histograms[id].speed);
+    }
+    render_finish(job);
+    return 0;
+  }
 
-    stats_vec_t stats_vec; // a tmp vector to sort or filter
-    if (strlen(api_state->channel) > 0) {
-      // filter by channel
-      size_t found;
-      for (it=channel_stats.begin(); it != channel_stats.end(); it++) {
-        found = it->first.find(api_state->channel);
-        if (found != std::string::npos)
-          stats_vec.push_back(*it);
-      }
-    } else {
-      for (it=channel_stats.begin(); it != channel_stats.end(); it++)
-        stats_vec.push_back(*it);
-      /* stats_vec.assign is not safe when map is being inserted concurrently */
+  job->shards = (render_shard *) TSmalloc(n * sizeof(render_shard));
+  job->num_shards = n;
+  job->pending = n;
+  for (int i = 0; i < n; i++) {
+    render_shard *shard = &job->shards[i];
+    shard->job = job;
+    shard->state = *state;
+    shard->state.resp_buffer = TSIOBufferCreate();
+    shard->reader = TSIOBufferReaderAlloc(shard->state.resp_buffer);
+    shard->state.merged = NULL;
+    shard->state.stage = API_STAGE_CHANNELS;
+    shard->begin = shard->state.cursor = (uint64_t) end * i / n;
+    shard->state.shard_end = (uint64_t) end * (i + 1) / n;
+    shard->merged = NULL;
+    if (state->merged) {
+      shard->merged = (channel_histograms *) TSmalloc(sizeof(channel_histograms));
+      memset(shard->merged, 0, sizeof(channel_histograms));
     }
+  }
+  for (int i = 1; i < n; i++) {
+    TSCont task = TSContCreate(render_shard_handle_event, TSMutexCreate());
+    TSContDataSet(task, &job->shards[i]);
+    TSContSchedule(task, 0, TS_THREAD_POOL_TASK);
+  }
+  render_shard_run(&job->shards[0]);
+  return 0;
+}
 
-    if (stats_vec.empty())
-      return;
+// render the body of the request on task threads, if it's worth it
+static void
+render_start(TSCont contp, intercept_state * api_state)
+{
+  render_job *job;
 
-    stats_vec_t::size_type out_st = stats_vec.size();
-    if (api_state->topn > 0) { // need sort and limit output size
-      if ((unsigned)api_state->topn < stats_vec.size())
-        out_st = (unsigned)api_state->topn;
-      else
-        api_state->topn = stats_vec.size();
-      std::partial_sort(stats_vec.begin(), stats_vec.begin() + api_state->topn,
-                        stats_vec.end(), compare<data_pair>());
-    } // else will output whole vector without sort
+  if (render_threads == 0 || api_state->deny || api_state->topn != -1 ||
+      is_sorted_output(api_state) || api_state->format == FORMAT_BIN)
+    return;
 
-    stats_vec_t::size_type i;
-    for (i = 0; i < out_st - 1; i++) {
-      append_channel_stat(api_state, stats_vec[i].first, stats_vec[i].second, 0);
-    }
-    append_channel_stat(api_state, stats_vec[i].first, stats_vec[i].second, 1);
+  job = (render_job *) TSmalloc(sizeof(*job));
+  memset(job, 0, sizeof(*job));
+  job->refcount = 2;
+  job->contp = contp;
+  job->state.show_global = api_state->show_global;
+  job->state.format = api_state->format;
+  job->state.channel = TSstrdup(api_state->channel);
+  job->state.prefix = TSstrdup(api_state->prefix);
+  job->state.suffix = TSstrdup(api_state->suffix);
+  job->state.topn = api_state->topn;
+  job->state.since = api_state->since;
+  job->state.sort = api_state->sort;
+  job->state.ascending = api_state->ascending;
+  job->state.fields = api_state->fields;
+  job->state.resp_buffer = TSIOBufferCreate();
+  job->reader = TSIOBufferReaderAlloc(job->state.resp_buffer);
+  api_state->job = job;
+
+  TSCont task = TSContCreate(render_start_handle_event, TSMutexCreate());
+  TSContDataSet(task, job);
+  TSContSchedule(task, 0, TS_THREAD_POOL_TASK);
+}
+
+// bytes of reader, appended to the response by reference
+static void
+text_append_reader(text_out * out, TSIOBufferReader reader, int64_t len, int64_t offset)
+{
+  text_flush(out);
+  out->api_state->output_bytes += TSIOBufferCopy(out->api_state->resp_buffer, reader, len, offset);
+}
 
+// append the rendered body to the response, on the net thread
+static void
+render_append(intercept_state * api_state)
+{
+  render_job *job = api_state->job;
+  text_out out;
+  int last = -1;
+
+  TSMutexLock(render_mutex);
+  job->done = NULL;
+  TSMutexUnlock(render_mutex);
+
+  out.api_state = api_state;
+  out.len = 0;
+  if (job->state.format == FORMAT_JSON) {
+    text_append_str(&out, "{ \"channel\": {\n");
+    for (int i = 0; i < job->num_shards; i++) {
+      if (job->shards[i].state.channels_out > 0)
+        last = i;
+    }
+    // a shard with channels ends with "\n", the separator of the next one goes before
+    for (int i = 0; i <= last; i++) {
+      const render_shard *shard = &job->shards[i];
+      if (shard->state.channels_out == 0)
+        continue;
+      if (i < last) {
+        text_append_reader(&out, shard->reader, shard->state.output_bytes - 1, 0);
+        text_append(&out, ",\n", 2);
+      } else {
+        text_append_reader(&out, shard->reader, shard->state.output_bytes, 0);
+      }
+    }
   } else {
-    smap_iterator last_it = channel_stats.end();
-    last_it--;
-    for (it = channel_stats.begin(); it != last_it; it++) {
-      append_channel_stat(api_state, it->first, it->second, 0);
+    for (int m = 0; m < NUM_CHANNEL_METRICS && job->state.count > 0; m++) {
+      if (!(job->state.fields & FIELD_METRIC(m)))
+        continue;
+      text_append_family(&out, channel_metrics[m].prometheus_name, channel_metrics[m].help, "counter");
+      for (int i = 0; i < job->num_shards; i++) {
+        const render_shard *shard = &job->shards[i];
+        int64_t from = m ? shard->metric_end[m - 1] : 0;
+        text_append_reader(&out, shard->reader, shard->metric_end[m] - from, from);
+      }
+      if (evict_idle > 0)
+        prometheus_out_evicted_sample(&out, job->state.view, m);
     }
-    append_channel_stat(api_state, it->first, it->second, 1);
   }
+  text_append_reader(&out, job->reader, job->state.output_bytes, 0);
+  text_flush(&out);
+
+  api_state->body_written = 1;
+  TSVIONBytesSet(api_state->write_vio, api_state->output_bytes);
+  api_state->job = NULL;
+  render_job_release(job);
+}
+
+/*
+  Shared memory export: with --shm=NAME, a task writes the binary output
+  of all channels to a shared memory segment every shm_interval seconds,
+  see channel_stats_shm.h. Nothing is added to txns.
+*/
+#define SHM_HEADER_SIZE 64 // data is cache line aligned
+
+static const char *shm_name = NULL;
+static int shm_interval = 1; // seconds
+static cstats_shm_header *shm = NULL;
+
+// bytes of binary output of MAX_MAP_SIZE channels at most
+static uint64_t
+shm_capacity()
+{
+  int n = NUM_CHANNEL_METRICS;
+  uint64_t column_names_size = 0;
+
+  for (int c = 0; c < n; c++)
+    column_names_size += strlen(channel_metrics[c].name) + 1;
+  return sizeof(cstats_bin_header) + cstats_bin_pad(column_names_size) +
+         cstats_bin_pad((uint64_t) MAX_MAP_SIZE * AVG_HOST_LEN) +
+         (uint64_t) n * MAX_MAP_SIZE * sizeof(uint64_t);
 }
 
 static void
-json_out_stats(intercept_state * api_state)
+shm_create()
 {
-  const char *version;
+  uint64_t capacity = shm_capacity();
+  size_t size = SHM_HEADER_SIZE + capacity;
+
+  int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    fatal("failed to open shared memory %s: %s", shm_name, strerror(errno));
+  if (ftruncate(fd, size) != 0)
+    fatal("failed to size shared memory %s: %s", shm_name, strerror(errno));
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    fatal("failed to map shared memory %s: %s", shm_name, strerror(errno));
+  close(fd);
+
+  // an existing segment is reused, so that readers which have it mapped
+  // see new data; seq is odd if last writer died while writing
+  shm = (cstats_shm_header *) p;
+  memcpy(shm->magic, CSTATS_SHM_MAGIC, sizeof(shm->magic));
+  shm->version = CSTATS_SHM_VERSION;
+  shm->header_size = SHM_HEADER_SIZE;
+  shm->capacity = capacity;
+  if (shm->seq & 1)
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
 
-  APPEND("{ \"channel\": {\n");
-  json_out_channel_stats(api_state);
-  APPEND("  },\n");
+static char *
+shm_write(char * p, const void * data, size_t len)
+{
+  memcpy(p, data, len);
+  return p + len;
+}
 
-  APPEND(" \"global\": {\n");
-  APPEND_STAT("response.count.2xx.get", "%" PRIu64, global_response_count_2xx_get);
-  APPEND_STAT("response.bytes.content", "%" PRIu64, global_response_bytes_content);
-  APPEND_STAT("channel.count", "%zu", channel_stats.size());
+static char *
+shm_write_padding(char * p, uint64_t size)
+{
+  memset(p, 0, cstats_bin_pad(size) - size);
+  return p + cstats_bin_pad(size) - size;
+}
 
-  if (api_state->show_global)
-    TSRecordDump(TS_RECORDTYPE_PROCESS, json_out_stat, api_state); // internal stats
+static int
+shm_handle_event(TSCont contp, TSEvent event, void *edata)
+{
+  int n = NUM_CHANNEL_METRICS;
+  counters_view *view = counters_type == COUNTERS_EPOCH ? view_acquire() : NULL;
+  channel_id count = view ? view->count : registry.size();
+  uint64_t generation = view ? view->generation : __atomic_load_n(&globals->generation, __ATOMIC_RELAXED);
+  char *data = (char *) shm + shm->header_size;
+  char *p = data;
+  cstats_bin_header header;
+  uint32_t column_names_size;
+  size_t names_size;
+  std::string names_copy;
+  const char *names = bin_channel_names(count, &names_copy, &names_size);
+  struct timeval now;
+
+  __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  column_names_size = bin_make_header(&header, view, count, generation, names_size);
+  p = shm_write(p, &header, sizeof(header));
+  for (int c = 0; c < n; c++)
+    p = shm_write(p, channel_metrics[c].name, strlen(channel_metrics[c].name) + 1);
+  p = shm_write_padding(p, column_names_size);
+  p = shm_write(p, names, names_size);
+  p = shm_write_padding(p, names_size);
+  for (int c = 0; c < n; c++) {
+    for (channel_id first = 0; first < count; first += CHANNEL_BLOCK_SIZE) {
+      uint32_t len = std::min((uint32_t) CHANNEL_BLOCK_SIZE, count - first);
+      read_channel_counters(view, first, len, channel_metrics[c].column, (uint64_t *) p);
+      p += len * sizeof(uint64_t);
+    }
+  }
 
-  version = TSTrafficServerVersionGet();
-  APPEND("\"server\": \"");
-  APPEND(version);
-  APPEND("\"\n");
+  gettimeofday(&now, NULL);
+  __atomic_store_n(&shm->data_size, p - data, __ATOMIC_RELAXED);
+  __atomic_store_n(&shm->publish_time, (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+  if (view)
+    view_release(view);
+
+  debug_api("shared memory published, %u channels, %" PRIu64 " bytes", count,
+            (uint64_t) (p - data));
+  TSContSchedule(contp, shm_interval * 1000, TS_THREAD_POOL_TASK);
+  return 0;
+}
 
-  APPEND("  }\n}\n");
+/*
+  Append next part of the body. A step which only scans channels appends
+  nothing, and a write vio reenabled with nothing to write is disabled
+  until it's reenabled again, so the next step is scheduled instead.
+*/
+static void
+stats_write_next(TSCont contp, intercept_state * api_state)
+{
+  int64_t output_bytes = api_state->output_bytes;
+
+  if (api_state->deny) {
+    APPEND("forbidden");
+    api_state->body_written = 1;
+  } else if (api_state->format == FORMAT_PROMETHEUS) {
+    api_state->body_written = prometheus_out_stats_step(api_state);
+  } else if (api_state->format == FORMAT_BIN) {
+    api_state->body_written = bin_out_stats_step(api_state);
+  } else {
+    api_state->body_written = json_out_stats_step(api_state);
+  }
+
+  if (api_state->body_written)
+    TSVIONBytesSet(api_state->write_vio, api_state->output_bytes);
+  else if (api_state->output_bytes == output_bytes)
+    api_state->pending = TSContSchedule(contp, 0, TS_THREAD_POOL_DEFAULT);
 }
 
 static void
 stats_process_write(TSCont contp, TSEvent event, intercept_state * api_state)
 {
   if (event == TS_EVENT_VCONN_WRITE_READY) {
-    if (api_state->body_written == 0) {
+    // wait until client has consumed most of the last chunk
+    if (api_state->body_written == 0 && api_state->pending == NULL && api_state->job == NULL &&
+        TSIOBufferReaderAvail(api_state->resp_reader) < API_CHUNK_SIZE) {
       debug_api("plugin adding response body");
-      api_state->body_written = 1;
-      if (!api_state->deny)
-        json_out_stats(api_state);
-      else
-        APPEND("forbidden");
-      TSVIONBytesSet(api_state->write_vio, api_state->output_bytes);
+      stats_write_next(contp, api_state);
     }
     TSVIOReenable(api_state->write_vio);
-  } else if (TS_EVENT_VCONN_WRITE_COMPLETE) {
+  } else if (event == TS_EVENT_VCONN_WRITE_COMPLETE) {
     stats_cleanup(contp, api_state);
   } else if (event == TS_EVENT_ERROR) {
     error_api("stats_process_write: Received TS_EVENT_ERROR\n");
@@ -781,6 +3809,16 @@ api_handle_event(TSCont contp, TSEvent event, void *edata)
   if (event == TS_EVENT_NET_ACCEPT) {
     api_state->net_vc = (TSVConn) edata;
     stats_process_accept(contp, api_state);
+  } else if (event == TS_EVENT_IMMEDIATE || event == TS_EVENT_TIMEOUT) {
+    // scheduled by stats_write_next(), immediate as its timeout is 0, or
+    // by render tasks once the body is rendered
+    if (api_state->job) {
+      render_append(api_state);
+    } else {
+      api_state->pending = NULL;
+      stats_write_next(contp, api_state);
+    }
+    TSVIOReenable(api_state->write_vio);
   } else if (edata == api_state->read_vio) {
     stats_process_read(contp, event, api_state);
   } else if (edata == api_state->write_vio) {
@@ -819,15 +3857,250 @@ check_ts_version()
   return result;
 }
 
-void
-TSPluginInit(int argc, const char *argv[])
+static void
+state_init_header(cstats_state_header *h)
+{
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, CSTATS_STATE_MAGIC, sizeof(h->magic));
+  h->version = CSTATS_STATE_VERSION;
+  h->max_channels = MAX_MAP_SIZE;
+  h->block_size = CHANNEL_BLOCK_SIZE;
+  h->block_bytes = sizeof(channel_block);
+  h->arena_size = (uint64_t) MAX_MAP_SIZE * AVG_HOST_LEN;
+  h->registry_size = channel_registry::memory_size(MAX_MAP_SIZE, h->arena_size);
+  h->hash_size = channel_hash::memory_size(MAX_MAP_SIZE);
+  h->metrics_hash = cstats_state_metrics_hash();
+  h->checksum = cstats_state_checksum(h);
+  h->globals.generation = 1;
+}
+
+// map state file of size bytes, a new one if it's empty, NULL if failed
+static cstats_state_header *
+state_map(const cstats_state_header *expected, size_t size)
+{
+  struct stat st;
+  int fd = state_fd = open(state_path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    fatal("failed to open state file %s: %s", state_path, strerror(errno));
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    fatal("state file %s is used by another process", state_path);
+  if (fstat(fd, &st) != 0)
+    fatal("failed to stat state file %s: %s", state_path, strerror(errno));
+
+  bool created = st.st_size == 0;
+  if (created && ftruncate(fd, size) != 0)
+    fatal("failed to grow state file %s: %s", state_path, strerror(errno));
+  if (!created && (size_t) st.st_size != size)
+    return NULL;
+
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    fatal("failed to map state file %s: %s", state_path, strerror(errno));
+  if (created)
+    memcpy(p, expected, sizeof(*expected));
+  return (cstats_state_header *) p;
+}
+
+/*
+  Attach registry and hash table to state file, created if it doesn't
+  exist. A file which doesn't match (version, layout, metrics, checksum) or
+  isn't sane is renamed to <path>.bad and stats start from zero.
+*/
+static void
+state_open()
+{
+  cstats_state_header expected;
+  state_init_header(&expected);
+  size_t size = CSTATS_STATE_HEADER_SIZE + expected.registry_size + expected.hash_size;
+
+  for (int retry = 0; ; retry++) {
+    cstats_state_header *h = state_map(&expected, size);
+    char *base = (char *) h + CSTATS_STATE_HEADER_SIZE;
+    if (h && memcmp(h, &expected, offsetof(cstats_state_header, count)) == 0 &&
+        h->count <= h->max_channels && h->indexed <= h->count) {
+      registry.attach(base, MAX_MAP_SIZE, expected.arena_size, h->count);
+      if (registry.valid(h->count)) {
+        state = h;
+        break;
+      }
+    }
+
+    if (retry > 0)
+      fatal("failed to create state file %s", state_path);
+    std::string bad = std::string(state_path) + ".bad";
+    warning("state file %s doesn't match, stats start from zero, it's kept as %s",
+            state_path, bad.c_str());
+    if (h)
+      munmap(h, size);
+    close(state_fd);
+    if (rename(state_path, bad.c_str()) != 0)
+      fatal("failed to rename state file %s: %s", state_path, strerror(errno));
+  }
+
+  globals = &state->globals;
+  if (index_type == INDEX_HASH)
+    channel_table = new channel_hash(&registry, MAX_MAP_SIZE,
+                                     (char *) state + CSTATS_STATE_HEADER_SIZE +
+                                     state->registry_size);
+  info("state file: %s, %u channels", state_path, state->count);
+}
+
+/*
+  index channels restored from state file, only the missing ones in hash
+  table. Marks of generations aren't in the file, a restored channel is
+  marked with the current generation, so a since= of before the restart
+  returns it.
+*/
+static void
+state_index_channels()
+{
+  const char *name;
+  size_t len;
+
+  for (channel_id id = 0; id < state->count; id++) {
+    name = registry.name(id, &len);
+    channel_generations[id] = globals->generation;
+    if (index_type == INDEX_HASH && id >= state->indexed)
+      channel_table->insert(name, len, id);
+    else if (index_type == INDEX_MAP)
+      channel_stats.insert(std::make_pair(std::string(name, len), id));
+    if (filter_index)
+      filter_index->add(id, name, len);
+  }
+  if (index_type == INDEX_HASH)
+    state->indexed = state->count;
+}
+
+/*
+  plugin.config: channel_stats.so [options] [api_path]
+  options:
+    --index=hash|map          channel index implementation, default hash
+    --counters=atomic|sharded|epoch
+                              counters update mode, default atomic
+    --epoch-interval=MS       fold epoch counters into a view every MS ms
+    --histograms              keep duration and speed histograms per channel
+    --rates                   keep 1s/10s/60s/5m rates per channel
+    --snapshot-interval=SEC   render output without parameters every SEC
+                              seconds and serve it to all requests
+    --top-interval=SEC        find top channels every SEC seconds for topn
+    --heavy-hitters=K         estimate top K hosts by requests and bytes
+    --filter-index            index channel names for channel/prefix/suffix
+    --state-file=PATH         keep counters in PATH across restarts
+    --shm=NAME                publish stats in shared memory NAME
+    --shm-interval=SEC        publish shared memory every SEC seconds, default 1
+    --evict-idle=MIN          evict channels without txn for MIN minutes
+    --render-threads=N        render responses of all channels on N task threads
+*/
+static void
+parse_args(int argc, const char *argv[])
 {
-  if (argc > 2) {
-    fatal("plugin does not accept more than 1 argument");
-  } else if (argc == 2) {
-    api_path = std::string(argv[1]);
+  static const struct option longopts[] = {
+    {"index", required_argument, NULL, 'i'},
+    {"counters", required_argument, NULL, 'c'},
+    {"histograms", no_argument, NULL, 'H'},
+    {"rates", no_argument, NULL, 'R'},
+    {"snapshot-interval", required_argument, NULL, 's'},
+    {"top-interval", required_argument, NULL, 't'},
+    {"heavy-hitters", required_argument, NULL, 'k'},
+    {"filter-index", no_argument, NULL, 'f'},
+    {"state-file", required_argument, NULL, 'S'},
+    {"shm", required_argument, NULL, 'm'},
+    {"shm-interval", required_argument, NULL, 'M'},
+    {"epoch-interval", required_argument, NULL, 'e'},
+    {"evict-idle", required_argument, NULL, 'x'},
+    {"render-threads", required_argument, NULL, 'r'},
+    {NULL, 0, NULL, 0}
+  };
+  int opt;
+
+  optind = 0; // reset getopt, argv[0] is plugin name
+  while ((opt = getopt_long(argc, (char * const *) argv, "", longopts, NULL)) != -1) {
+    switch (opt) {
+    case 'i':
+      if (strcmp(optarg, "hash") == 0)
+        index_type = INDEX_HASH;
+      else if (strcmp(optarg, "map") == 0)
+        index_type = INDEX_MAP;
+      else
+        fatal("unknown index type: %s", optarg);
+      break;
+    case 'c':
+      if (strcmp(optarg, "atomic") == 0)
+        counters_type = COUNTERS_ATOMIC;
+      else if (strcmp(optarg, "sharded") == 0)
+        counters_type = COUNTERS_SHARDED;
+      else if (strcmp(optarg, "epoch") == 0)
+        counters_type = COUNTERS_EPOCH;
+      else
+        fatal("unknown counters type: %s", optarg);
+      break;
+    case 'H':
+      enable_histograms = true;
+      break;
+    case 'R':
+      enable_rates = true;
+      break;
+    case 's':
+      snapshot_interval = atoi(optarg);
+      if (snapshot_interval <= 0)
+        fatal("invalid snapshot interval: %s", optarg);
+      break;
+    case 't':
+      top_interval = atoi(optarg);
+      if (top_interval <= 0)
+        fatal("invalid top interval: %s", optarg);
+      break;
+    case 'k':
+      heavy_hitters_size = atoi(optarg);
+      if (heavy_hitters_size <= 0 || heavy_hitters_size > MAX_HEAVY_HITTERS)
+        fatal("invalid number of heavy hitters: %s", optarg);
+      break;
+    case 'f':
+      enable_filter_index = true;
+      break;
+    case 'S':
+      state_path = optarg;
+      break;
+    case 'm':
+      shm_name = optarg;
+      break;
+    case 'M':
+      shm_interval = atoi(optarg);
+      if (shm_interval <= 0)
+        fatal("invalid shared memory interval: %s", optarg);
+      break;
+    case 'e':
+      epoch_interval = atoi(optarg);
+      if (epoch_interval <= 0)
+        fatal("invalid epoch interval: %s", optarg);
+      break;
+    case 'x':
+      evict_idle = atoi(optarg) * 60;
+      if (evict_idle <= 0)
+        fatal("invalid eviction idle time: %s", optarg);
+      break;
+    case 'r':
+      render_threads = atoi(optarg);
+      if (render_threads <= 0 || render_threads > MAX_RENDER_THREADS)
+        fatal("invalid number of render threads: %s", optarg);
+      break;
+    default:
+      fatal("unknown plugin argument");
+    }
+  }
+
+  if (argc - optind > 1) {
+    fatal("plugin does not accept more than 1 api path");
+  } else if (argc - optind == 1) {
+    api_path = std::string(argv[optind]);
     debug_api("stats api path: %s", api_path.c_str());
   }
+}
+
+void
+TSPluginInit(int argc, const char *argv[])
+{
+  parse_args(argc, argv);
 
   TSPluginRegistrationInfo info;
 
@@ -845,7 +4118,92 @@ TSPluginInit(int argc, const char *argv[])
 
   info("%s(%s) plugin starting...", PLUGIN_NAME, PLUGIN_VERSION);
 
+  if (TSHttpArgIndexReserve(PLUGIN_NAME, "channel stat of txn", &txn_arg_idx) != TS_SUCCESS) {
+    fatal("failed to reserve txn arg index");
+  }
+
   stats_map_mutex = TSMutexCreate();
+  filter_index_mutex = TSMutexCreate();
+  if (state_path) {
+    if (counters_type != COUNTERS_ATOMIC)
+      fatal("state file needs atomic counters");
+    if (evict_idle > 0)
+      fatal("state file can't be used with eviction");
+    state_open();
+  } else {
+    if (!registry.init(MAX_MAP_SIZE, (size_t) MAX_MAP_SIZE * AVG_HOST_LEN)) {
+      fatal("failed to reserve memory for %d channels", MAX_MAP_SIZE);
+    }
+    if (evict_idle > 0 && !registry.enable_reuse())
+      fatal("failed to reserve memory for channel reuse");
+    if (index_type == INDEX_HASH)
+      channel_table = new channel_hash(&registry, MAX_MAP_SIZE);
+  }
+  channel_generations = (uint64_t *) reserve_pages(MAX_MAP_SIZE * sizeof(uint64_t));
+  if (!channel_generations)
+    fatal("failed to reserve memory for channel generations");
+  if (enable_histograms) {
+    histograms = (channel_histograms *) reserve_pages(MAX_MAP_SIZE * sizeof(channel_histograms));
+    if (!histograms)
+      fatal("failed to reserve memory for histograms");
+  }
+  if (enable_filter_index) {
+    filter_index = new channel_filter_index;
+    info("filter index: on");
+  }
+  if (state)
+    state_index_channels();
+  if (enable_rates) {
+    rates = (channel_rates *) reserve_pages(MAX_MAP_SIZE * sizeof(channel_rates));
+    if (!rates)
+      fatal("failed to reserve memory for rates");
+  }
+  info("channel index: %s", index_type == INDEX_HASH ? "hash" : "map");
+  info("counters: %s", counters_type == COUNTERS_SHARDED ? "sharded" :
+                       counters_type == COUNTERS_EPOCH ? "epoch" : "atomic");
+
+  if (evict_idle > 0) {
+    info("evict idle channels: after %d min", evict_idle / 60);
+    if (counters_type != COUNTERS_EPOCH) // else the fold sweeps
+      TSContSchedule(TSContCreate(evict_handle_event, TSMutexCreate()),
+                     EVICT_SWEEP_INTERVAL * 1000, TS_THREAD_POOL_TASK);
+  }
+
+  view_mutex = TSMutexCreate();
+  if (counters_type == COUNTERS_EPOCH) {
+    current_view = (counters_view *) cache_line_alloc(sizeof(counters_view));
+    if (!current_view)
+      fatal("failed to allocate counters view");
+    current_view->refcount = 1;
+    current_view->generation = globals->generation;
+    info("epoch interval: %dms", epoch_interval);
+    TSContSchedule(TSContCreate(epoch_handle_event, TSMutexCreate()), 0, TS_THREAD_POOL_TASK);
+  }
+
+  snapshot_mutex = TSMutexCreate();
+  if (snapshot_interval > 0) {
+    info("snapshot interval: %ds", snapshot_interval);
+    TSContSchedule(TSContCreate(snapshot_handle_event, TSMutexCreate()), 0, TS_THREAD_POOL_TASK);
+  }
+
+  if (heavy_hitters_size)
+    info("heavy hitters: %u", heavy_hitters_size);
+
+  render_mutex = TSMutexCreate();
+  if (render_threads > 0)
+    info("render threads: %d", render_threads);
+
+  top_cache_mutex = TSMutexCreate();
+  if (top_interval > 0) {
+    info("top interval: %ds", top_interval);
+    TSContSchedule(TSContCreate(top_handle_event, TSMutexCreate()), 0, TS_THREAD_POOL_TASK);
+  }
+
+  if (shm_name) {
+    shm_create();
+    info("shared memory: %s, every %ds", shm_name, shm_interval);
+    TSContSchedule(TSContCreate(shm_handle_event, TSMutexCreate()), 0, TS_THREAD_POOL_TASK);
+  }
 
   TSCont cont = TSContCreate(handle_event, NULL);
   TSHttpHookAdd(TS_HTTP_READ_REQUEST_HDR_HOOK, cont);
@@ -0,0 +1,68 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_STATS_BIN_H
+#define _CHANNEL_STATS_BIN_H
+
+#include <stdint.h>
+
+/*
+  Binary output (?format=bin), shared by the plugin and tools/cstats_decode.
+  All integers are in host byte order, see byte_order. Sections follow each
+  other, each one padded with zeros to a multiple of 8 bytes:
+
+  - header: struct cstats_bin_header, header_size bytes
+  - column names: num_columns null-terminated strings,
+    column_names_size bytes with padding
+  - channel names: num_channels null-terminated strings in channel id
+    order, names_size bytes with padding, an evicted channel has an
+    empty name and is to be skipped
+  - columns: num_columns arrays of num_channels uint64_t, in the order of
+    column names, the i-th value of each is the counter of i-th channel
+
+  A reader must skip header_size bytes of header, newer versions may append
+  fields to it, and refuse a different major version.
+*/
+
+#define CSTATS_BIN_MAGIC "CSTB"
+#define CSTATS_BIN_VERSION 1
+#define CSTATS_BIN_BYTE_ORDER 0x0102
+#define CSTATS_BIN_ALIGN 8
+
+struct cstats_bin_header {
+  char magic[4]; // CSTATS_BIN_MAGIC, not null-terminated
+  uint16_t version; // CSTATS_BIN_VERSION
+  uint16_t byte_order; // CSTATS_BIN_BYTE_ORDER as written by the plugin
+  uint32_t header_size;
+  uint32_t num_channels;
+  uint32_t num_columns;
+  uint32_t column_names_size;
+  uint64_t names_size;
+  // global stats
+  uint64_t response_count_2xx_get;
+  uint64_t response_bytes_content;
+  uint64_t generation; // for since parameter of next request
+};
+
+static inline uint64_t
+cstats_bin_pad(uint64_t size)
+{
+  return (size + CSTATS_BIN_ALIGN - 1) & ~(uint64_t) (CSTATS_BIN_ALIGN - 1);
+}
+
+#endif //_CHANNEL_STATS_BIN_H
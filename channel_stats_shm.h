@@ -0,0 +1,84 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef _CHANNEL_STATS_SHM_H
+#define _CHANNEL_STATS_SHM_H
+
+#include <stdint.h>
+#include <cstring>
+
+/*
+  Shared memory export (--shm=NAME), shared by the plugin and local
+  readers such as tools/cstats_shm. The plugin publishes all stats every
+  interval in a POSIX shared memory segment NAME:
+
+  - struct cstats_shm_header, header_size bytes
+  - data_size bytes of data: the binary output of channel_stats_bin.h,
+    as ?format=bin returns it, capacity bytes are reserved for it
+
+  The plugin is the only writer and data is guarded by a seqlock: seq is
+  odd while it's written. A reader copies data between two loads of a
+  same even seq, else it tries again, cstats_shm_read() does it. It takes
+  no lock, a reader never blocks the plugin.
+*/
+
+#define CSTATS_SHM_MAGIC "CSTM"
+#define CSTATS_SHM_VERSION 1
+
+struct cstats_shm_header {
+  char magic[4]; // CSTATS_SHM_MAGIC, not null-terminated
+  uint32_t version; // CSTATS_SHM_VERSION
+  uint32_t header_size;
+  uint32_t seq; // odd while data is written
+  uint64_t capacity; // bytes reserved for data
+  // guarded by seq
+  uint64_t data_size;
+  uint64_t publish_time; // unix time of data, in ms
+};
+
+/*
+  Copy a consistent snapshot of data to buf of size bytes, return its
+  size, or 0 if there is no data yet, it doesn't fit or it kept changing
+  for tries attempts. publish_time is set if not NULL.
+*/
+static inline uint64_t
+cstats_shm_read(const cstats_shm_header *h, void *buf, uint64_t size, int tries,
+                uint64_t *publish_time)
+{
+  const char *data = (const char *) h + h->header_size;
+
+  while (tries-- > 0) {
+    uint32_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue; // being written
+    uint64_t data_size = __atomic_load_n(&h->data_size, __ATOMIC_RELAXED);
+    uint64_t time = __atomic_load_n(&h->publish_time, __ATOMIC_RELAXED);
+    if (data_size > size || data_size > h->capacity)
+      return 0;
+    memcpy(buf, data, data_size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq)
+      continue;
+    if (publish_time)
+      *publish_time = time;
+    return data_size;
+  }
+  return 0;
+}
+
+#endif //_CHANNEL_STATS_SHM_H
@@ -0,0 +1,133 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Reference decoder of the binary output of channel_stats (?format=bin),
+  prints it as tab separated values, a line per channel.
+
+  usage: cstats_decode [file]   (reads stdin without file)
+  e.g.   curl -s 'http://127.0.0.1/_cstats?format=bin' | cstats_decode
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+#include "../channel_stats_bin.h"
+
+static bool
+read_all(FILE *f, std::string *data)
+{
+  char buf[65536];
+  size_t n;
+
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    data->append(buf, n);
+  return !ferror(f);
+}
+
+static int
+fail(const char *msg)
+{
+  fprintf(stderr, "cstats_decode: %s\n", msg);
+  return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  std::string data;
+  FILE *f = stdin;
+
+  if (argc > 2)
+    return fail("usage: cstats_decode [file]");
+  if (argc == 2 && !(f = fopen(argv[1], "rb")))
+    return fail("cannot open input file");
+  if (!read_all(f, &data))
+    return fail("read error");
+
+  cstats_bin_header h;
+  if (data.size() < sizeof(h))
+    return fail("input is too short");
+  memcpy(&h, data.data(), sizeof(h));
+  if (memcmp(h.magic, CSTATS_BIN_MAGIC, sizeof(h.magic)) != 0)
+    return fail("not a channel_stats binary output");
+  if (h.version != CSTATS_BIN_VERSION)
+    return fail("unsupported version");
+  if (h.byte_order != CSTATS_BIN_BYTE_ORDER)
+    return fail("written with another byte order");
+  if (h.header_size < sizeof(h))
+    return fail("bad header size");
+
+  // sections, see channel_stats_bin.h
+  uint64_t column_names_at = h.header_size;
+  uint64_t names_at = column_names_at + h.column_names_size;
+  uint64_t columns_at = names_at + h.names_size;
+  uint64_t end = columns_at + (uint64_t) h.num_columns * h.num_channels * sizeof(uint64_t);
+  if (data.size() < end)
+    return fail("input is truncated");
+
+  std::vector<const char *> columns;
+  const char *p = data.data() + column_names_at;
+  for (uint32_t c = 0; c < h.num_columns; c++) {
+    if (!memchr(p, '\0', data.data() + names_at - p))
+      return fail("bad column names");
+    columns.push_back(p);
+    p += strlen(p) + 1;
+  }
+
+  std::vector<const char *> names;
+  uint32_t live = 0; // an evicted channel has an empty name
+  p = data.data() + names_at;
+  for (uint32_t i = 0; i < h.num_channels; i++) {
+    if (!memchr(p, '\0', data.data() + columns_at - p))
+      return fail("bad channel names");
+    names.push_back(p);
+    if (*p)
+      live++;
+    p += strlen(p) + 1;
+  }
+
+  printf("# global response.count.2xx.get=%" PRIu64 " response.bytes.content=%" PRIu64
+         " channel.count=%" PRIu32 " generation=%" PRIu64 "\n",
+         h.response_count_2xx_get, h.response_bytes_content, live,
+         h.generation);
+  printf("channel");
+  for (uint32_t c = 0; c < h.num_columns; c++)
+    printf("\t%s", columns[c]);
+  printf("\n");
+
+  const char *values = data.data() + columns_at;
+  for (uint32_t i = 0; i < h.num_channels; i++) {
+    if (!*names[i])
+      continue;
+    printf("%s", names[i]);
+    for (uint32_t c = 0; c < h.num_columns; c++) {
+      uint64_t v;
+      memcpy(&v, values + ((uint64_t) c * h.num_channels + i) * sizeof(uint64_t), sizeof(v));
+      printf("\t%" PRIu64, v);
+    }
+    printf("\n");
+  }
+
+  if (f != stdin)
+    fclose(f);
+  return 0;
+}
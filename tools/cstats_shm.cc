@@ -0,0 +1,86 @@
+/*
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Reader of the shared memory export of channel_stats (--shm=NAME): takes
+  a consistent snapshot without lock and writes it to stdout in the
+  binary format, as ?format=bin returns it.
+
+  usage: cstats_shm NAME
+  e.g.   cstats_shm /channel_stats | cstats_decode
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../channel_stats_shm.h"
+
+#define READ_TRIES 100 // with 1ms sleep, the plugin writes for a few ms
+
+static int
+fail(const char *msg)
+{
+  fprintf(stderr, "cstats_shm: %s\n", msg);
+  return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct stat st;
+
+  if (argc != 2)
+    return fail("usage: cstats_shm NAME");
+
+  int fd = shm_open(argv[1], O_RDONLY, 0);
+  if (fd < 0)
+    return fail("cannot open shared memory");
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(cstats_shm_header))
+    return fail("shared memory is too small");
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return fail("cannot map shared memory");
+
+  const cstats_shm_header *h = (const cstats_shm_header *) p;
+  if (memcmp(h->magic, CSTATS_SHM_MAGIC, sizeof(h->magic)) != 0)
+    return fail("not a channel_stats shared memory");
+  if (h->version != CSTATS_SHM_VERSION)
+    return fail("unsupported version");
+  if (h->header_size + h->capacity > (uint64_t) st.st_size)
+    return fail("bad header");
+
+  std::vector<char> buf(h->capacity);
+  uint64_t size = 0;
+  for (int i = 0; i < READ_TRIES && size == 0; i++) {
+    size = cstats_shm_read(h, &buf[0], buf.size(), 1, NULL);
+    if (size == 0)
+      usleep(1000);
+  }
+  if (size == 0)
+    return fail("no data, or it kept changing");
+
+  if (fwrite(&buf[0], 1, size, stdout) != size)
+    return fail("write error");
+  return 0;
+}